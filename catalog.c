@@ -0,0 +1,403 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Catalog records: one per directory entry, printed for -F or kept in
+ * a catalog store (-S) for later queries (-q).
+ *
+ * The store is a text file:
+ *	tsbtap-catalog 1
+ * followed by one line per directory entry, fields separated by tabs,
+ * in the order of cat_fields; a missing value is "\N". Storing a tape
+ * replaces any records already stored for the same image path.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "sink.h"
+#include "outfile.h"
+#include "catalog.h"
+#include "match.h"
+#include "tsbtap.h"
+
+#define CAT_MAGIC	"tsbtap-catalog 1\n"
+#define CAT_NULL	"\\N"
+
+static const struct {
+	char	*cf_name;
+	int	cf_isnum;
+} cat_fields[CF_NFIELDS] = {
+	{ "tape",	0 },
+	{ "offset",	1 },
+	{ "reel",	1 },
+	{ "kind",	0 },
+	{ "date",	0 },
+	{ "uid",	0 },
+	{ "name",	0 },
+	{ "type",	0 },
+	{ "mode",	0 },
+	{ "sanctified",	1 },
+	{ "length",	1 },
+	{ "recsz",	1 },
+	{ "accessed",	0 },
+	{ "device",	0 },
+	{ "flags",	1 },
+};
+
+
+void cat_print_header(tsb_ctx_t *tsb)
+{
+	int i;
+
+	if (tsb->ts_format != FMT_CSV)
+		return;
+	for (i = 0; i < CF_NFIELDS; i++)
+		fprintf(tsb->ts_out, "%s%s", i ? "," : "",
+			cat_fields[i].cf_name);
+	putc('\n', tsb->ts_out);
+}
+
+
+static void print_string(tsb_ctx_t *tsb, char *str)
+{
+	FILE *fp = tsb->ts_out;
+
+	if (tsb->ts_format == FMT_CSV && !strpbrk(str, ",\"\r\n")) {
+		fputs(str, fp);
+		return;
+	}
+
+	putc('"', fp);
+	for (; *str; str++) {
+		if (*str == '"')
+			putc(tsb->ts_format == FMT_CSV ? '"' : '\\', fp);
+		else if (*str == '\\' && tsb->ts_format == FMT_JSON)
+			putc('\\', fp);
+		if (tsb->ts_format == FMT_JSON && (unsigned char) *str < ' ')
+			fprintf(fp, "\\u%04x", *str);
+		else
+			putc(*str, fp);
+	}
+	putc('"', fp);
+}
+
+
+/* vals[i] is field i, NULL if missing */
+void cat_print(tsb_ctx_t *tsb, char **vals)
+{
+	int i;
+	FILE *fp = tsb->ts_out;
+
+	switch (tsb->ts_format) {
+	    case FMT_TEXT:		/* query results */
+		fprintf(fp, "%s @%s  %s/%-6s %1s%1s %5s  %s\n",
+			vals[CF_TAPE], vals[CF_OFFSET] ? vals[CF_OFFSET] : "?",
+			vals[CF_UID], vals[CF_NAME], vals[CF_TYPE],
+			vals[CF_MODE], vals[CF_LENGTH],
+			vals[CF_ACCESSED] ? vals[CF_ACCESSED] : "");
+		return;
+
+	    case FMT_STORE:
+		for (i = 0; i < CF_NFIELDS; i++)
+			fprintf(fp, "%s%s", i ? "\t" : "",
+				vals[i] ? vals[i] : CAT_NULL);
+		putc('\n', fp);
+		return;
+	}
+
+	for (i = 0; i < CF_NFIELDS; i++) {
+		if (tsb->ts_format == FMT_JSON)
+			fprintf(fp, "%s\"%s\":", i ? "," : "{",
+				cat_fields[i].cf_name);
+		else if (i)
+			putc(',', fp);
+
+		if (!vals[i]) {
+			if (tsb->ts_format == FMT_JSON)
+				fputs("null", fp);
+		} else if (cat_fields[i].cf_isnum)
+			fputs(vals[i], fp);
+		else
+			print_string(tsb, vals[i]);
+	}
+	fputs(tsb->ts_format == FMT_JSON ? "}\n" : "\n", fp);
+}
+
+
+/* split store line into fields, in place */
+/* returns -1 if wrong number of fields */
+static int cat_split(char *line, char **vals)
+{
+	int i;
+	char *sp = line;
+
+	for (i = 0; i < CF_NFIELDS; i++) {
+		vals[i] = sp;
+		sp = strchr(sp, i < CF_NFIELDS-1 ? '\t' : '\n');
+		if (sp)
+			*sp++ = '\0';
+		else if (i < CF_NFIELDS-1)
+			return -1;
+		if (strcmp(vals[i], CAT_NULL) == 0)
+			vals[i] = NULL;
+	}
+	return 0;
+}
+
+
+/* returns stream positioned after magic, NULL if error */
+static FILE *cat_open(char *store)
+{
+	FILE *fp;
+	char magic[sizeof(CAT_MAGIC)];
+
+	if (!(fp = fopen(store, "r")))
+		return NULL;
+	if (!fgets(magic, sizeof(magic), fp) || strcmp(magic, CAT_MAGIC)) {
+		fprintf(stderr, "%s: not a tsbtap catalog\n", store);
+		fclose(fp);
+		errno = 0;
+		return NULL;
+	}
+	return fp;
+}
+
+
+/* recs: store lines (FMT_STORE) for one or more tapes, grouped by tape */
+/* returns -1 if error */
+int cat_store(char *store, char *recs, size_t len)
+{
+	FILE *ifp, *ofp;
+	char *tmp, *line = NULL, *sp, *ep;
+	char **tapes = NULL;
+	size_t linesz = 0, tlen;
+	int i, ntapes = 0, rv = -1;
+
+	/* tapes being replaced */
+	for (sp = recs; sp < recs + len; sp = ep + 1) {
+		ep = memchr(sp, '\n', recs + len - sp);
+		if (!ep)
+			break;
+		tlen = strcspn(sp, "\t");
+		if (ntapes && strncmp(tapes[ntapes-1], sp, tlen) == 0 &&
+		    tapes[ntapes-1][tlen] == '\0')
+			continue;
+		if (!(tapes = realloc(tapes, (ntapes+1) * sizeof(char *))) ||
+		    !(tapes[ntapes] = strndup(sp, tlen))) {
+			fprintf(stderr, "%s: out of memory\n", store);
+			return -1;
+		}
+		ntapes++;
+	}
+
+	tmp = malloc(strlen(store) + 5);
+	if (!tmp) {
+		fprintf(stderr, "%s: out of memory\n", store);
+		goto out;
+	}
+	sprintf(tmp, "%s.tmp", store);
+	if (!(ofp = fopen(tmp, "w"))) {
+		perror(tmp);
+		goto out;
+	}
+	fputs(CAT_MAGIC, ofp);
+
+	/* keep records of other tapes */
+	ifp = cat_open(store);
+	if (!ifp && errno != ENOENT) {
+		if (errno)
+			perror(store);
+		fclose(ofp);
+		unlink(tmp);
+		goto out;
+	}
+	while (ifp && getline(&line, &linesz, ifp) > 0) {
+		tlen = strcspn(line, "\t");
+		for (i = 0; i < ntapes; i++)
+			if (strncmp(tapes[i], line, tlen) == 0 &&
+			    tapes[i][tlen] == '\0')
+				break;
+		if (i == ntapes)
+			fputs(line, ofp);
+	}
+	if (ifp)
+		fclose(ifp);
+
+	fwrite(recs, 1, len, ofp);
+	if (fclose(ofp) != 0 || rename(tmp, store) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		goto out;
+	}
+	rv = 0;
+
+out:
+	for (i = 0; i < ntapes; i++)
+		free(tapes[i]);
+	free(tapes);
+	free(tmp);
+	free(line);
+	return rv;
+}
+
+
+/*
+ * -q: query catalog store.
+ */
+
+typedef struct {
+	char	*qf_tape;		/* glob on image path */
+	char	*qf_type;		/* type letters; B = BASIC program */
+	char	*qf_from, *qf_to;	/* accessed, YYYY-MM-DD, inclusive */
+	long	qf_minlen, qf_maxlen;
+} cat_filter_t;
+
+
+/* returns 1 if record passes filter */
+static int cat_filter(cat_filter_t *qf, char **vals)
+{
+	char type;
+	long len;
+
+	if (qf->qf_tape && fnmatch(qf->qf_tape, vals[CF_TAPE], 0) != 0)
+		return 0;
+	if (qf->qf_type) {
+		type = vals[CF_TYPE] && vals[CF_TYPE][0] ? vals[CF_TYPE][0]
+							  : 'B';
+		if (!strchr(qf->qf_type, type))
+			return 0;
+	}
+	if (qf->qf_from && (!vals[CF_ACCESSED] ||
+			    strcmp(vals[CF_ACCESSED], qf->qf_from) < 0))
+		return 0;
+	if (qf->qf_to && (!vals[CF_ACCESSED] ||
+			  strncmp(vals[CF_ACCESSED], qf->qf_to,
+				  strlen(qf->qf_to)) > 0))
+		return 0;
+	len = vals[CF_LENGTH] ? atol(vals[CF_LENGTH]) : 0;
+	if (len < qf->qf_minlen || len > qf->qf_maxlen)
+		return 0;
+	return 1;
+}
+
+
+/* args are id/name patterns (as for -x), or filters key=value */
+/* returns 1 if bad args or store, 3 if a pattern matched nothing, else 0 */
+int cat_query(tsb_ctx_t *tsb, char *store, int argc, char **argv)
+{
+	cat_filter_t qf;
+	FILE *fp;
+	char *line = NULL, *vals[CF_NFIELDS], *sp;
+	char **pats;
+	size_t linesz = 0;
+	int i, npats = 0, lineno = 1, ec = 0, all = 0;
+	matcher_t *m;
+
+	memset(&qf, 0, sizeof(cat_filter_t));
+	qf.qf_minlen = LONG_MIN;
+	qf.qf_maxlen = LONG_MAX;
+
+	pats = malloc((argc + 1) * sizeof(char *));
+	if (!pats) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (!(sp = strchr(argv[i], '='))) {
+			pats[npats++] = argv[i];
+			continue;
+		}
+		*sp++ = '\0';
+		if (strcmp(argv[i], "tape") == 0)
+			qf.qf_tape = sp;
+		else if (strcmp(argv[i], "type") == 0)
+			qf.qf_type = sp;
+		else if (strcmp(argv[i], "from") == 0)
+			qf.qf_from = sp;
+		else if (strcmp(argv[i], "to") == 0)
+			qf.qf_to = sp;
+		else if (strcmp(argv[i], "minlen") == 0)
+			qf.qf_minlen = atol(sp);
+		else if (strcmp(argv[i], "maxlen") == 0)
+			qf.qf_maxlen = atol(sp);
+		else {
+			fprintf(stderr, "-q: unknown filter %s\n", argv[i]);
+			free(pats);
+			return 1;
+		}
+	}
+
+	/* no names: all files, less any excluded */
+	if (npats == 0) {
+		pats[npats++] = "*";
+		all = 1;
+	}
+
+	if (!(m = match_init(npats, pats, tsb->ts_nexcl, tsb->ts_excl))) {
+		fprintf(stderr, "Out of memory\n");
+		free(pats);
+		return 1;
+	}
+
+	if (!(fp = cat_open(store))) {
+		if (errno)
+			perror(store);
+		match_free(m);
+		free(pats);
+		return 1;
+	}
+
+	cat_print_header(tsb);
+	while (getline(&line, &linesz, fp) > 0) {
+		lineno++;
+		if (cat_split(line, vals) < 0 || !vals[CF_TAPE] ||
+		    !vals[CF_UID] || !vals[CF_NAME] || !vals[CF_TYPE] ||
+		    !vals[CF_MODE] || !vals[CF_LENGTH]) {
+			fprintf(stderr, "%s: line %d: bad record\n", store,
+				lineno);
+			ec = 1;
+			continue;
+		}
+		if (!cat_filter(&qf, vals))
+			continue;
+		if (!match_find(m, vals[CF_UID], vals[CF_NAME], &i))
+			continue;
+		match_found(m, i);
+		cat_print(tsb, vals);
+	}
+	fclose(fp);
+	free(line);
+
+	if (!all && m->mt_nfound < npats)
+		for (i = 0; i < npats; i++)
+			if (!m->mt_found[i]) {
+				fprintf(stderr, "%s not found\n", pats[i]);
+				ec = MAX(ec, 3);
+			}
+	match_free(m);
+	free(pats);
+	return ec;
+}
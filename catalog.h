@@ -0,0 +1,52 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Catalog records: one per directory entry, printed for -F or kept in
+ * a catalog store (-S) for later queries (-q).
+ */
+
+#ifndef _CATALOG_H
+#define _CATALOG_H 1
+
+struct tsb_ctx;
+
+/* record fields, in order */
+#define CF_TAPE		0
+#define CF_OFFSET	1
+#define CF_REEL		2
+#define CF_KIND		3
+#define CF_DATE		4
+#define CF_UID		5
+#define CF_NAME		6
+#define CF_TYPE		7
+#define CF_MODE		8
+#define CF_SANCT	9
+#define CF_LENGTH	10
+#define CF_RECSZ	11
+#define CF_ACCESSED	12
+#define CF_DEVICE	13
+#define CF_FLAGS	14
+#define CF_NFIELDS	15
+
+extern void cat_print_header(struct tsb_ctx *tsb);
+extern void cat_print(struct tsb_ctx *tsb, char **vals);
+extern int cat_store(char *store, char *recs, size_t len);
+extern int cat_query(struct tsb_ctx *tsb, char *store, int argc,
+		     char **argv);
+
+#endif /* _CATALOG_H */
@@ -46,8 +46,9 @@ void raw_copy(tfile_ctx_t *tf, tfile_ctx_t *otf)
 
 #define VERR(str)							\
     do {								\
-	if (verbose > 1 || verbose && !ec)				\
-		printf("%s line %d: %s\n", pname, lineno, str);		\
+	if (tsb->ts_verbose > 1 || tsb->ts_verbose && !ec)		\
+		fprintf(tsb->ts_out, "%s line %d: %s\n",		\
+			pname, lineno, str);				\
         ec++;								\
     } while (0)
 
@@ -60,6 +61,7 @@ void raw_copy(tfile_ctx_t *tf, tfile_ctx_t *otf)
 char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 			tfile_ctx_t *tf, tfile_ctx_t *otf)
 {
+	tsb_ctx_t *tsb = tf->tf_tsb;
 	prog_ctx_t prog, saveprog;	/* program being read */
 	stmt_ctx_t ctx;			/* statement being read */
 	char *err = NULL;
@@ -68,13 +70,15 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 	int pbufsz = 8 * TBLOCKSIZE;	/* should hold largest TSB program */
 	int poff = 0;
 
-	if (prog_init(&prog, tf) < 0)
+	if (prog_init(&prog, tf, 2 * -(int16_t) BE16(dbuf+22)) < 0)
 		return "";
 
 	if (dbuf[6] & 0x80) {		/* CSAVEd */
 		err = un_csave(&prog, dbuf);
-		if (err)
+		if (err) {
+			prog_fini(&prog);
 			return err;
+		}
 		dbuf[6] &= 0x7f;
 	} else
 		prog_setsz(&prog, 2 * -(int16_t) BE16(dbuf+22));
@@ -86,7 +90,7 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 	for (saveprog = prog;
 	     (lineno = stmt_init(&ctx, &prog)) >= 0;
 	     saveprog = prog) {
-		SINK *snp;
+		SINK stmt_sink, *snp = &stmt_sink;
 		unsigned char *pb, *tbuf;
 		int stlen;
 		int stmt = -1;
@@ -96,16 +100,18 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 
 		/* grow program buffer if no room for stmt */
 		if (poff + STLEN_ACCESS + 1 > pbufsz) {
-			pbufsz += TBLOCKSIZE;
-			if (!(pbuf = realloc(pbuf, pbufsz))) {
+			pbufsz *= 2;
+			if (!(pb = realloc(pbuf, pbufsz))) {
 				prog_fini(&prog);
+				free(pbuf);
 				return "Out of memory for converting tape";
 			}
+			pbuf = pb;
 		}
 
 		/* start new statement; reserve space for lineno, length */
 		pb = pbuf + poff;
-		snp = sink_initstr(pb, STLEN_ACCESS+1);
+		sink_initview(snp, pb, STLEN_ACCESS+1);
 		sink_write(snp, zero, 4);
 
 		while (stmt_getbytes(&ctx, &tbuf, 2) == 2) {
@@ -241,7 +247,7 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 			}
 		}
 
-		stlen = sink_fini(snp);
+		stlen = sink_finiview(snp);
 		stmt_fini(&ctx);
 
 		if (err)
@@ -250,7 +256,7 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 		/* too long */
 		if (stlen > STLEN_ACCESS) {
 			/* report error unless -e */
-			if (!ignore_errs) {
+			if (!tsb->ts_ignerr) {
 				err = "statement too long";
 				goto finish;
 			}
@@ -259,7 +265,7 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 			/* redo as REM */
 			prog = saveprog;
 			(void) stmt_init(&ctx, &prog);
-			snp = sink_initstr(pb, STLEN_ACCESS);
+			sink_initview(snp, pb, STLEN_ACCESS);
 			sink_write(snp, zero, 4);
 
 			sink_putc(051 << 1, snp);   	/* REM */
@@ -267,7 +273,7 @@ char *convert_prog_ftoa(char *pname, unsigned char *dbuf,
 			sink_putc('T', snp);		/* reason */
 			(void) print_stmt(snp, &ctx);
 
-			stlen = sink_fini(snp);
+			stlen = sink_finiview(snp);
 			stmt_fini(&ctx);
 
 			/* append null if not at 16-bit word boundary */
@@ -305,7 +311,7 @@ finish:
 }
 
 
-int do_aopt(TAPE *tap, TAPE *ot)
+int do_aopt(tsb_ctx_t *tsb, TAPE *tap, TAPE *ot)
 {
 	unsigned char *tbuf;
 	ssize_t nread;
@@ -325,8 +331,8 @@ int do_aopt(TAPE *tap, TAPE *ot)
 		}
 
 		/* TSB label? update and write */
-		if (is_tsb_label(tbuf, nread)) {
-			if (is_access > 0) {
+		if (is_tsb_label(tsb, tbuf, nread)) {
+			if (tsb->ts_access > 0) {
 				fprintf(stderr,
 					"%s: already in Access format\n",
 					tap->tp_path);
@@ -347,17 +353,17 @@ int do_aopt(TAPE *tap, TAPE *ot)
 			tap_writeblock(ot, NULL, 0);	/* tapemark */
 
 			/* skip Hibernate or Sleep data structures */
-			tfile_ctx_init(&tf, tap, tbuf, nread, 0);
+			tfile_ctx_init(&tf, tsb, tap, tbuf, nread, 0);
 			goto next;
 		}
 
 		if (!octx_init) {
-			tfile_ctx_init(&otf, ot, NULL, TBLOCKSIZE+24, 0);
+			tfile_ctx_init(&otf, tsb, ot, NULL, TBLOCKSIZE+24, 0);
 			octx_init = 1;
 		}
 
 		/* read directory entry */
-		tfile_ctx_init(&tf, tap, tbuf, nread, 2);
+		tfile_ctx_init(&tf, tsb, tap, tbuf, nread, 2);
 		if (tfile_getbytes(&tf, dbuf, 24) < 24)
 			goto next;
 
@@ -394,18 +400,19 @@ int do_aopt(TAPE *tap, TAPE *ot)
 		} else {
 			char *err = convert_prog_ftoa(oname, dbuf, &tf, &otf);
 			if (err) {
-				printf("Skipping %s: %s\n", oname, err);
+				fprintf(tsb->ts_out, "Skipping %s: %s\n",
+					oname, err);
 				goto next;
 			}
 		}
 
 		tfile_writef(&otf, 24);
 
-		if (verbose) {
-			printf("Converted %s", oname);
+		if (tsb->ts_verbose) {
+			fprintf(tsb->ts_out, "Converted %s", oname);
 			if (renamed)
-				printf(" -> %s", name);
-			printf("\n");
+				fprintf(tsb->ts_out, " -> %s", name);
+			fprintf(tsb->ts_out, "\n");
 		}
 next:
 		tfile_skipf(&tf);
@@ -429,6 +436,7 @@ done:
 char *convert_prog_atof(char *pname, unsigned char *dbuf,
 			tfile_ctx_t *tf, tfile_ctx_t *otf)
 {
+	tsb_ctx_t *tsb = tf->tf_tsb;
 	prog_ctx_t prog, saveprog;	/* program being read */
 	stmt_ctx_t ctx;			/* statement being read */
 	char *err = NULL;
@@ -437,13 +445,15 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 	int pbufsz = 8 * TBLOCKSIZE;	/* should hold largest TSB program */
 	int poff = 0;
 
-	if (prog_init(&prog, tf) < 0)
+	if (prog_init(&prog, tf, 2 * -(int16_t) BE16(dbuf+22)) < 0)
 		return "";
 
 	if (dbuf[6] & 0x80) {		/* CSAVEd */
 		err = un_csave(&prog, dbuf);
-		if (err)
+		if (err) {
+			prog_fini(&prog);
 			return err;
+		}
 		dbuf[6] &= 0x7f;
 	} else
 		prog_setsz(&prog, 2 * -(int16_t) BE16(dbuf+22));
@@ -455,7 +465,7 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 	for (saveprog = prog;
 	     (lineno = stmt_init(&ctx, &prog)) >= 0;
 	     saveprog = prog) {
-		SINK *snp;
+		SINK stmt_sink, *snp = &stmt_sink;
 		unsigned char *pb, *tbuf;
 		int stlen;
 		int stmt = -1;
@@ -468,16 +478,18 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 
 		/* grow program buffer if no room for stmt */
 		if (poff + STLEN_2000F + 1 > pbufsz) {
-			pbufsz += TBLOCKSIZE;
-			if (!(pbuf = realloc(pbuf, pbufsz))) {
+			pbufsz *= 2;
+			if (!(pb = realloc(pbuf, pbufsz))) {
 				prog_fini(&prog);
+				free(pbuf);
 				return "Out of memory for converting tape";
 			}
+			pbuf = pb;
 		}
 
 		/* start new statement; reserve space for lineno, length */
 		pb = pbuf + poff;
-		snp = sink_initstr(pb, STLEN_2000F+1);
+		sink_initview(snp, pb, STLEN_2000F+1);
 		sink_write(snp, zero, 4);
 
 		while (stmt_getbytes(&ctx, &tbuf, 2) == 2) {
@@ -732,7 +744,7 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 			}
 		}
 
-		stlen = sink_fini(snp);
+		stlen = sink_finiview(snp);
 		stmt_fini(&ctx);
 
 		if (err)
@@ -741,7 +753,7 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 		/* too long or unsupported */
 		if (stlen > STLEN_2000F || unsupp) {
 			/* report error unless -e */
-			if (!ignore_errs) {
+			if (!tsb->ts_ignerr) {
 				err = unsupp ? "unsupported construct"
 					     : "statement too long";
 				goto finish;
@@ -750,7 +762,7 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 			/* redo as REM */
 			prog = saveprog;
 			(void) stmt_init(&ctx, &prog);
-			snp = sink_initstr(pb, STLEN_2000F);
+			sink_initview(snp, pb, STLEN_2000F);
 			sink_write(snp, zero, 4);
 
 			if (!unsupp) {
@@ -762,7 +774,7 @@ char *convert_prog_atof(char *pname, unsigned char *dbuf,
 			sink_putc(unsupp, snp);		/* reason */
 			(void) print_stmt(snp, &ctx);
 
-			stlen = sink_fini(snp);
+			stlen = sink_finiview(snp);
 			stmt_fini(&ctx);
 
 			/* append null if not at 16-bit word boundary */
@@ -800,7 +812,7 @@ finish:
 }
 
 
-int do_copt(TAPE *tap, TAPE *ot)
+int do_copt(tsb_ctx_t *tsb, TAPE *tap, TAPE *ot)
 {
 	unsigned char *tbuf;
 	ssize_t nread;
@@ -820,8 +832,8 @@ int do_copt(TAPE *tap, TAPE *ot)
 		}
 
 		/* TSB label? update and write */
-		if (is_tsb_label(tbuf, nread)) {
-			if (is_access <= 0) {
+		if (is_tsb_label(tsb, tbuf, nread)) {
+			if (tsb->ts_access <= 0) {
 				fprintf(stderr,
 					"%s: already in 2000F format\n",
 					tap->tp_path);
@@ -842,17 +854,17 @@ int do_copt(TAPE *tap, TAPE *ot)
 			tap_writeblock(ot, NULL, 0);	/* tapemark */
 
 			/* skip Hibernate or Sleep data structures */
-			tfile_ctx_init(&tf, tap, tbuf, nread, 0);
+			tfile_ctx_init(&tf, tsb, tap, tbuf, nread, 0);
 			goto next;
 		}
 
 		if (!octx_init) {
-			tfile_ctx_init(&otf, ot, NULL, TBLOCKSIZE+24, 2);
+			tfile_ctx_init(&otf, tsb, ot, NULL, TBLOCKSIZE+24, 2);
 			octx_init = 1;
 		}
 
 		/* read directory entry */
-		tfile_ctx_init(&tf, tap, tbuf, nread, 0);
+		tfile_ctx_init(&tf, tsb, tap, tbuf, nread, 0);
 		if (tfile_getbytes(&tf, dbuf, 24) < 24)
 			goto next;
 
@@ -868,7 +880,7 @@ int do_copt(TAPE *tap, TAPE *ot)
 
 		/* skip ASCII files */
 		if (dbuf[2] & 0x80) {
-			printf("Skipped ASCII file %s\n", name);
+			fprintf(tsb->ts_out, "Skipped ASCII file %s\n", name);
 			goto next;
 		}
 
@@ -887,15 +899,16 @@ int do_copt(TAPE *tap, TAPE *ot)
 		} else {
 			char *err = convert_prog_atof(name, dbuf, &tf, &otf);
 			if (err) {
-				printf("Skipping %s: %s\n", name, err);
+				fprintf(tsb->ts_out, "Skipping %s: %s\n",
+					name, err);
 				goto next;
 			}
 		}
 
 		tfile_writef(&otf, 24);
 
-		if (verbose) {
-			printf("Converted %s\n", name);
+		if (tsb->ts_verbose) {
+			fprintf(tsb->ts_out, "Converted %s\n", name);
 		}
 
 next:
@@ -25,7 +25,7 @@
 #define STLEN_ACCESS	999	/* TBD */
 #define STLEN_2000F	204	/* TBD */
 
-extern int do_aopt(TAPE *tap, TAPE *ot);
-extern int do_copt(TAPE *tap, TAPE *ot);
+extern int do_aopt(struct tsb_ctx *tsb, TAPE *tap, TAPE *ot);
+extern int do_copt(struct tsb_ctx *tsb, TAPE *tap, TAPE *ot);
 
 #endif /* _CONVERT_H */
@@ -0,0 +1,249 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Format HP 2000 floating-point numbers as TSB BASIC prints them.
+ *
+ * A number is a 24-bit two's complement mantissa (binary point after the
+ * sign bit) and a 7-bit exponent with the sign in the low bit. It is
+ * printed as C's "%G" would print it, rounding correctly to 6 digits,
+ * with these changes:
+ *	.5 and 1.E-07, not 0.5 and 1E-07
+ *	.00001 and .000001, not 1E-05 and 1E-06
+ *	1.23457E-04, not 0.000123457
+ *	32768. through 999999. end with '.'
+ * The digits are found exactly, using only integer arithmetic.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include "hpfloat.h"
+
+#define HPF_NDIG	6	/* significant digits, as for "%G" */
+#define HPF_MAXLIMB	5	/* 32-bit limbs for fraction: 2^-151 */
+
+static const uint64_t pow10[] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+	10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+	100000000000ull, 1000000000000ull, 10000000000000ull,
+	100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+	100000000000000000ull, 1000000000000000000ull,
+	10000000000000000000ull
+};
+
+
+/* append decimal digits of n, at least width of them */
+static char *put_digits(char *dp, uint64_t n, int width)
+{
+	int i, nd;
+
+	for (nd = 1; nd < 20 && n >= pow10[nd]; nd++)
+		;
+	for (i = width; i > nd; i--)
+		*dp++ = '0';
+	for (i = nd - 1; i >= 0; i--) {
+		*dp++ = '0' + n / pow10[i];
+		n %= pow10[i];
+	}
+	return dp;
+}
+
+
+/*
+ * Digits of m * 2^e, m > 0: at least HPF_NDIG+1 significant digits, or
+ * all of them if fewer. Returns number of digits before the point, which
+ * may be negative for leading zeros after it; *sticky set if any nonzero
+ * digits were left out. *big set if 32767 < m * 2^e < 1000000.
+ */
+static int hpf_digits(uint32_t m, int e, char *dig, int *ndig, int *sticky,
+		      int *big)
+{
+	uint32_t frac[HPF_MAXLIMB];
+	uint64_t t, chunk, carry;
+	uint32_t ip;
+	int i, k, nlimb, top, npoint;
+	char *dp = dig;
+
+	/* integer: up to 2^127, as 64-bit halves */
+	if (e >= 0) {
+		unsigned __int128 n = (unsigned __int128) m << e;
+		uint64_t hi = n / pow10[19], lo = n % pow10[19];
+
+		if (hi)
+			dp = put_digits(put_digits(dp, hi, 0), lo, 19);
+		else
+			dp = put_digits(dp, lo, 0);
+		*ndig = dp - dig;
+		*sticky = 0;
+		*big = n > 32767 && n < 1000000;
+		return *ndig;
+	}
+
+	/* integer part, if any; m < 2^24 */
+	k = -e;
+	ip = k < 24 ? m >> k : 0;
+	if (ip)
+		dp = put_digits(dp, ip, 0);
+	npoint = dp - dig;
+
+	/* fraction, k bits, in limbs low to high */
+	nlimb = (k + 31) / 32;
+	memset(frac, 0, sizeof(frac));
+	frac[0] = k < 32 ? m & ((1u << k) - 1) : m;
+	top = k - 32 * (nlimb - 1);	/* bits used in top limb */
+	*big = ip < 1000000 && (ip > 32767 || (ip == 32767 && frac[0]));
+
+	/* 9 digits at a time */
+	while (1) {
+		for (i = 0; i < nlimb && !frac[i]; i++)
+			;
+		if (i == nlimb)
+			break;		/* rest are zeros */
+		for (i = 0; i < dp - dig && dig[i] == '0'; i++)
+			;
+		if (dp - dig - i > HPF_NDIG)
+			break;		/* enough */
+
+		carry = 0;
+		for (i = 0; i < nlimb; i++) {
+			t = (uint64_t) frac[i] * 1000000000u + carry;
+			frac[i] = (uint32_t) t;
+			carry = t >> 32;
+		}
+		if (top == 32)
+			chunk = carry;
+		else {
+			chunk = (carry << (32 - top)) | (frac[nlimb-1] >> top);
+			frac[nlimb-1] &= (1u << top) - 1;
+		}
+		dp = put_digits(dp, chunk, 9);
+	}
+
+	for (i = 0; i < nlimb && !frac[i]; i++)
+		;
+	*sticky = i < nlimb;
+	*ndig = dp - dig;
+	return npoint;
+}
+
+
+/* format number in buf (4 bytes) into out (HPF_BUFSZ) */
+/* returns length */
+int hpf_format(unsigned char *buf, char *out)
+{
+	char dig[96], *sp, *op = out;
+	int32_t mant;
+	int i, e, x, nd, ndig, npoint, sticky, big, up, z;
+
+	mant = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+	if (buf[0] & 0x80)	/* negative: sign-extend */
+		mant |= 0xff000000;
+	if (mant == 0) {
+		strcpy(out, "0");
+		return 1;
+	}
+	if (mant < 0) {
+		*op++ = '-';
+		mant = -mant;
+	}
+
+	e = buf[3] >> 1;
+	if (buf[3] & 1)		/* negative exponent */
+		e -= 128;
+	npoint = hpf_digits(mant, e - 23, dig, &ndig, &sticky, &big);
+
+	/* skip leading zeros: value is 0.dig[z]... * 10^(npoint-z) */
+	for (z = 0; dig[z] == '0'; z++)
+		;
+	x = npoint - z - 1;	/* exponent, as for "%E" */
+	sp = dig + z;
+	nd = ndig - z;
+
+	/* round to HPF_NDIG digits, ties to even */
+	for (i = nd; i <= HPF_NDIG; i++)
+		sp[i] = '0';
+	for (i = HPF_NDIG + 1; i < nd; i++)
+		if (sp[i] != '0')
+			sticky = 1;
+	up = sp[HPF_NDIG] > '5' ||
+	     (sp[HPF_NDIG] == '5' && (sticky || (sp[HPF_NDIG-1] & 1)));
+	for (i = HPF_NDIG - 1; up && i >= 0; i--) {
+		if (sp[i] == '9')
+			sp[i] = '0';
+		else {
+			sp[i]++;
+			up = 0;
+		}
+	}
+	if (up) {		/* 999999.5 -> 1000000 */
+		sp[0] = '1';
+		x++;
+	}
+
+	/* drop trailing zeros */
+	for (nd = HPF_NDIG; nd > 1 && sp[nd-1] == '0'; nd--)
+		;
+
+	if (x >= HPF_NDIG || x < -6 || (x < -4 && nd > 1)) {
+		/* d.dddddE+dd, with '.' even if no more digits */
+		*op++ = sp[0];
+		*op++ = '.';
+		memcpy(op, sp + 1, nd - 1);
+		op += nd - 1;
+		*op++ = 'E';
+		*op++ = x < 0 ? '-' : '+';
+		if (x < 0)
+			x = -x;
+		op = put_digits(op, x, 2);
+
+		/* 999999.5 and up rounds to 1.E+06, but gets '.' too */
+		if (nd == 1 && big)
+			*op++ = '.';
+
+	} else if (x < 0) {
+		/* .000ddd, or d.ddddE-0d if more than 6 digits after '.' */
+		if (-x - 1 + nd > HPF_NDIG) {
+			*op++ = sp[0];
+			*op++ = '.';
+			memcpy(op, sp + 1, nd - 1);
+			op += nd - 1;
+			*op++ = 'E';
+			*op++ = '-';
+			op = put_digits(op, -x, 2);
+		} else {
+			*op++ = '.';
+			for (i = -1; i > x; i--)
+				*op++ = '0';
+			memcpy(op, sp, nd);
+			op += nd;
+		}
+
+	} else {
+		/* ddd.ddd, or ddd. if large integer */
+		for (i = 0; i <= x || i < nd; i++) {
+			if (i == x + 1)
+				*op++ = '.';
+			*op++ = i < nd ? sp[i] : '0';
+		}
+		if (nd <= x + 1 && big)
+			*op++ = '.';
+	}
+
+	*op = '\0';
+	return op - out;
+}
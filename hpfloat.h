@@ -0,0 +1,29 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Format HP 2000 floating-point numbers as TSB BASIC prints them.
+ */
+
+#ifndef _HPFLOAT_H
+#define _HPFLOAT_H 1
+
+#define HPF_BUFSZ	16	/* enough for "-1.23457E-38." and NUL */
+
+extern int hpf_format(unsigned char *buf, char *out);
+
+#endif /* _HPFLOAT_H */
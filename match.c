@@ -0,0 +1,233 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * File name patterns ("id/name" or "name"), compiled for quick matching.
+ *
+ * A pattern's id part, if any, matches any id it is a prefix of, so an
+ * id such as "A000" has only a few prefixes ("", "A", "A0", ...) to look
+ * up. Patterns without wildcards are hashed on "prefix/name", so they
+ * cost nothing to match however many there are. Patterns with wildcards
+ * are kept in a list per id prefix, and only the lists for the id being
+ * matched are tried. As with name_match() over the args in order, the
+ * first matching arg wins.
+ *
+ * Names matching an exclude pattern (-X) never match.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sink.h"
+#include "outfile.h"
+#include "match.h"
+#include "tsbtap.h"
+
+#define MT_KEYSZ	32	/* room for a lookup key; longer keys never match */
+
+
+static unsigned mt_hash(char *key)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+
+	while (*key)
+		h = (h ^ (unsigned char) *key++) * 16777619u;
+	return h;
+}
+
+
+static mt_ent_t *mt_lookup(matcher_t *m, char *key)
+{
+	mt_ent_t *ent;
+
+	for (ent = m->mt_hash[mt_hash(key) & (m->mt_hashsz - 1)]; ent;
+	     ent = ent->me_next)
+		if (strcmp(ent->me_key, key) == 0)
+			return ent;
+	return NULL;
+}
+
+
+/* returns entry for key, added if needed; NULL if out of memory */
+static mt_ent_t *mt_add(matcher_t *m, char *key)
+{
+	mt_ent_t *ent, **hp;
+
+	if (ent = mt_lookup(m, key))
+		return ent;
+
+	ent = malloc(sizeof(mt_ent_t));
+	if (!ent || !(ent->me_key = strdup(key))) {
+		free(ent);
+		return NULL;
+	}
+	ent->me_arg = -1;
+	ent->me_globs = NULL;
+	ent->me_nglob = 0;
+
+	hp = &m->mt_hash[mt_hash(key) & (m->mt_hashsz - 1)];
+	ent->me_next = *hp;
+	*hp = ent;
+	return ent;
+}
+
+
+/* upper case copy of n bytes of str into buf */
+static void mt_upcase(char *buf, char *str, int n)
+{
+	while (n-- > 0 && *str)
+		*buf++ = toupper((unsigned char) *str++);
+	*buf = '\0';
+}
+
+
+/* returns NULL if out of memory */
+matcher_t *match_init(int argc, char **argv, int nexcl, char **excl)
+{
+	matcher_t *m;
+	mt_ent_t *ent;
+	char key[MT_KEYSZ], *sp, *pat;
+	int i, idlen, *globs;
+
+	m = calloc(1, sizeof(matcher_t));
+	if (!m)
+		return NULL;
+	m->mt_argc = argc;
+	m->mt_argv = argv;
+	for (m->mt_hashsz = 16; m->mt_hashsz < 2 * argc; m->mt_hashsz *= 2)
+		;
+	m->mt_hash = calloc(m->mt_hashsz, sizeof(mt_ent_t *));
+	m->mt_found = calloc(argc + 1, 1);
+	if (!m->mt_hash || !m->mt_found)
+		goto nomem;
+	if (nexcl && !(m->mt_exclude = match_init(nexcl, excl, 0, NULL)))
+		goto nomem;
+
+	for (i = 0; i < argc; i++) {
+		sp = strchr(argv[i], '/');
+		idlen = sp ? sp - argv[i] : 0;
+		pat = sp ? sp+1 : argv[i];
+
+		/* id too long to match any id */
+		if (idlen + 1 > MT_KEYSZ)
+			continue;
+
+		mt_upcase(key, argv[i], idlen);
+		if (strpbrk(pat, "*?[\\")) {
+			ent = mt_add(m, key);
+			if (!ent)
+				goto nomem;
+			globs = realloc(ent->me_globs,
+					(ent->me_nglob+1) * sizeof(int));
+			if (!globs)
+				goto nomem;
+			ent->me_globs = globs;
+			ent->me_globs[ent->me_nglob++] = i;
+		} else {
+			/* too long to match any id and name */
+			if (idlen + strlen(pat) + 2 > MT_KEYSZ)
+				continue;
+			strcat(key, "/");
+			mt_upcase(key + idlen + 1, pat, MT_KEYSZ);
+			ent = mt_add(m, key);
+			if (!ent)
+				goto nomem;
+			if (ent->me_arg < 0)
+				ent->me_arg = i;
+		}
+	}
+	return m;
+
+nomem:
+	match_free(m);
+	return NULL;
+}
+
+
+/* index of matching arg returned in *ip */
+/* returns matched name (see name_match), NULL if no match */
+char *match_find(matcher_t *m, char *id, char *name, int *ip)
+{
+	mt_ent_t *ent;
+	char key[MT_KEYSZ];
+	int i, j, n, best = m->mt_argc;
+	int exact = strlen(id) + strlen(name) + 2 <= MT_KEYSZ;
+
+	if (strlen(id) + 1 > MT_KEYSZ)
+		return NULL;
+	if (m->mt_exclude && match_find(m->mt_exclude, id, name, &i))
+		return NULL;
+
+	for (n = 0; n <= strlen(id); n++) {
+		mt_upcase(key, id, n);
+		if (ent = mt_lookup(m, key)) {
+			for (j = 0; j < ent->me_nglob; j++) {
+				i = ent->me_globs[j];
+				if (i >= best)
+					break;
+				if (name_match(m->mt_argv[i], id, name))
+					best = i;
+			}
+		}
+
+		if (!exact)
+			continue;
+		strcat(key, "/");
+		mt_upcase(key + n + 1, name, MT_KEYSZ);
+		ent = mt_lookup(m, key);
+		if (ent && ent->me_arg >= 0 && ent->me_arg < best)
+			best = ent->me_arg;
+	}
+
+	if (best == m->mt_argc)
+		return NULL;
+	*ip = best;
+	return name_match(m->mt_argv[best], id, name);
+}
+
+
+/* note that arg i matched a file */
+void match_found(matcher_t *m, int i)
+{
+	if (!m->mt_found[i]) {
+		m->mt_found[i] = 1;
+		m->mt_nfound++;
+	}
+}
+
+
+void match_free(matcher_t *m)
+{
+	mt_ent_t *ent, *next;
+	unsigned i;
+
+	if (m->mt_exclude)
+		match_free(m->mt_exclude);
+	for (i = 0; m->mt_hash && i < m->mt_hashsz; i++)
+		for (ent = m->mt_hash[i]; ent; ent = next) {
+			next = ent->me_next;
+			free(ent->me_key);
+			free(ent->me_globs);
+			free(ent);
+		}
+	free(m->mt_hash);
+	free(m->mt_found);
+	free(m);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * File name patterns ("id/name" or "name"), compiled for quick matching.
+ */
+
+#ifndef _MATCH_H
+#define _MATCH_H 1
+
+typedef struct mt_ent {
+	char		*me_key;	/* upper case "id/name", or "id" */
+	int		me_arg;		/* name: first arg with this key */
+	int		*me_globs;	/* id: wildcard args, in arg order */
+	int		me_nglob;
+	struct mt_ent	*me_next;
+} mt_ent_t;
+
+typedef struct matcher {
+	int		mt_argc;
+	char		**mt_argv;
+	mt_ent_t	**mt_hash;
+	unsigned	mt_hashsz;	/* power of 2 */
+	struct matcher	*mt_exclude;	/* names never matched, or NULL */
+	char		*mt_found;	/* args that matched a file */
+	int		mt_nfound;
+} matcher_t;
+
+extern matcher_t *match_init(int argc, char **argv, int nexcl,
+			     char **excl);
+extern char *match_find(matcher_t *m, char *id, char *name, int *ip);
+extern void match_found(matcher_t *m, int i);
+extern void match_free(matcher_t *m);
+
+#endif /* _MATCH_H */
@@ -22,6 +22,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <time.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -34,7 +36,38 @@
 #include "outfile.h"
 #include "tsbtap.h"
 
-int sout = 0;
+/* set while this thread's output is being deferred, see out_defer_begin */
+static __thread out_defer_t *defer = NULL;
+
+/* sink (from out_open with -O) that shares the stream for messages */
+static __thread SINK *msg_snp = NULL;
+
+/*
+ * With -o, extracted files are written as entries of a tar archive
+ * (POSIX ustar) instead of to the file system; with -H, as framed
+ * entries on stdout; with -C, into a content-addressed store, listed in
+ * a manifest. Each file is collected in memory, since its size (or
+ * hash) goes ahead of the data, and written out when the next one is
+ * opened or the archive is closed, so that set_mtime can still supply
+ * the entry's date.
+ */
+typedef struct out_arch {
+	FILE		*oa_fp;		/* archive, stream or manifest */
+	char		*oa_path;	/* for messages */
+	int		oa_format;	/* ARCH_* */
+	char		*oa_store;	/* ARCH_STORE: directory */
+	SINK		*oa_snp;	/* sink for the file being extracted */
+	int		oa_pending;	/* entry below not yet written */
+	char		*oa_name;
+	char		*oa_sfx;
+	char		*oa_data;
+	size_t		oa_datalen;
+	time_t		oa_mtime;	/* -1 if not known */
+	int		oa_err;		/* an entry couldn't be written */
+} out_arch_t;
+
+#define TAR_BLOCKSZ	512
+#define STORE_MAXSFX	100	/* most -C objects sharing a hash */
 
 
 /* match pattern as "id/pat" or "pat" */
@@ -66,14 +99,16 @@ char *name_match(char *pattern, char *id, char *name)
 /* returns -1 if failure */
 int jdate_to_tm(int yr, int jday, struct tm *tm)
 {
-	static char days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
-	int i;
+	static const char days[12] = {31, 28, 31, 30, 31, 30,
+				      31, 31, 30, 31, 30, 31};
+	int i, n;
 
-	days[1] = 28 + (yr % 4 == 0);
+	/* called from worker threads: table is read-only */
 	for (i = 0; i < 12; i++) {
-		if (jday - days[i] <= 0)
+		n = days[i] + (i == 1 && yr % 4 == 0);
+		if (jday - n <= 0)
 			break;
-		jday -= days[i];
+		jday -= n;
 	}
 	if (i == 12)
 		return -1;
@@ -87,13 +122,20 @@ int jdate_to_tm(int yr, int jday, struct tm *tm)
 }
 
 
-void set_mtime(char *fname, struct tm *tm)
+void set_mtime(tsb_ctx_t *tsb, char *fname, struct tm *tm)
 {
 	struct timeval times[2];
+	out_arch_t *ar = tsb->ts_arch;
 
 	if (!fname[0])
 		return;
 
+	if (defer) {
+		defer->od_tm = *tm;
+		defer->od_mtime = 1;
+		return;
+	}
+
 	tm->tm_isdst = -1;
 	times[1].tv_sec = mktime(tm);
 	if (times[1].tv_sec == -1) {
@@ -101,6 +143,12 @@ void set_mtime(char *fname, struct tm *tm)
 		return;
 	}
 
+	/* entry not yet written to archive */
+	if (ar && ar->oa_pending && strcmp(fname, ar->oa_name) == 0) {
+		ar->oa_mtime = times[1].tv_sec;
+		return;
+	}
+
 	times[0].tv_sec = time(NULL);
 	times[0].tv_usec = times[1].tv_usec = 0;
 	if (utimes(fname, times) < 0) {
@@ -110,61 +158,753 @@ void set_mtime(char *fname, struct tm *tm)
 }
 
 
-/* actual file name returned in fname */
-SINK *out_open(char *name, char *sfx, char *fname)
+/*
+ * Registry of the directories out_open has made or used, and the file
+ * names issued in them, so a unique name can be chosen without probing
+ * the file system. A directory that already existed is read once, when
+ * first used, to learn the names already taken. Directories are entered
+ * with a trailing '/'; files by their path, with the next suffix to try
+ * if the name is asked for again.
+ */
+typedef struct out_ent {
+	char		*oe_path;
+	int		oe_seq;		/* file: next ".n" suffix to try */
+	struct out_ent	*oe_next;
+} out_ent_t;
+
+typedef struct out_names {
+	out_ent_t	**on_hash;
+	int		on_hashsz;	/* power of 2 */
+	int		on_count;
+} out_names_t;
+
+
+static unsigned on_hash(char *key)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+
+	while (*key) {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static out_ent_t *names_find(out_names_t *on, char *path)
 {
-	int i;
-	char *sp;
-	FILE *fp;
-	SINK *rv = NULL;
+	out_ent_t *ent;
 
-	if (sout) {
-		fname[0] = '\0';
-		return sink_initf(stdout);
+	for (ent = on->on_hash[on_hash(path) & (on->on_hashsz - 1)]; ent;
+	     ent = ent->oe_next)
+		if (strcmp(ent->oe_path, path) == 0)
+			return ent;
+	return NULL;
+}
+
+
+/* returns -1 if out of memory */
+static int names_add(out_names_t *on, char *path)
+{
+	out_ent_t *ent, *next, **nhash, **hp;
+	int i, nsz;
+
+	if (names_find(on, path))
+		return 0;
+
+	/* keep chains short */
+	if (on->on_count >= on->on_hashsz) {
+		nsz = 2 * on->on_hashsz;
+		if (!(nhash = calloc(nsz, sizeof(out_ent_t *))))
+			return -1;
+		for (i = 0; i < on->on_hashsz; i++)
+			for (ent = on->on_hash[i]; ent; ent = next) {
+				next = ent->oe_next;
+				hp = &nhash[on_hash(ent->oe_path) & (nsz - 1)];
+				ent->oe_next = *hp;
+				*hp = ent;
+			}
+		free(on->on_hash);
+		on->on_hash = nhash;
+		on->on_hashsz = nsz;
+	}
+
+	if (!(ent = malloc(sizeof(out_ent_t))))
+		return -1;
+	if (!(ent->oe_path = strdup(path))) {
+		free(ent);
+		return -1;
+	}
+	ent->oe_seq = 1;
+	hp = &on->on_hash[on_hash(path) & (on->on_hashsz - 1)];
+	ent->oe_next = *hp;
+	*hp = ent;
+	on->on_count++;
+	return 0;
+}
+
+
+/* enter names of files in existing directory dir ("" if current) */
+/* returns -1 if out of memory */
+static int names_seed(out_names_t *on, char *dir)
+{
+	char path[OUT_NAMESZ];
+	struct dirent *de;
+	DIR *dp;
+	int rv = 0;
+
+	dprint(("names_seed: %s\n", dir));
+	if (!(dp = opendir(*dir ? dir : ".")))
+		return 0;
+	while (rv == 0 && (de = readdir(dp))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof path, "%s%s%s", dir, *dir ? "/" : "",
+			 de->d_name);
+		rv = names_add(on, path);
+	}
+	closedir(dp);
+	return rv;
+}
+
+
+/* register directory dir, making it if needed */
+/* returns -1 if error */
+static int names_dir(out_names_t *on, char *dir)
+{
+	char key[OUT_NAMESZ];
+
+	snprintf(key, sizeof key, "%s/", dir);
+	if (names_find(on, key))
+		return 0;
+
+	if (!*dir || mkdir(dir, 0777) < 0) {
+		if (*dir && errno != EEXIST) {
+			perror(dir);
+			return -1;
+		}
+		if (names_seed(on, dir) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+	if (names_add(on, key) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
 	}
+	return 0;
+}
+
 
-	sprintf(fname, "%s.%s", name, sfx);
+/* create and register directories leading up to file path */
+/* returns -1 if error */
+static int make_dirs(out_names_t *on, char *path)
+{
+	char *sp;
+	int rv = 0;
 
-	/* ensure subdirectory exists */
-	if (sp = strchr(fname, '/')) {
+	for (sp = strchr(path+1, '/'); sp; sp = strchr(sp+1, '/')) {
 		*sp = 0;
-                if (mkdir(fname, 0777) < 0 && errno != EEXIST) {
-                        fprintf(stderr, "%s: mkdir: ", sp+1);
-                        perror(fname);
-                        return NULL;
-                }
+		rv = names_dir(on, path);
 		*sp = '/';
+		if (rv < 0)
+			return rv;
 	}
 
-	for (i = 0; i < 100; i++) {
-		fp = fopen(fname, "wx");
-		if (fp) {
-			printf("Extracting to %s\n", fname);
+	/* file goes in current directory */
+	if (!strchr(path+1, '/') && path[0] != '/')
+		rv = names_dir(on, "");
+	return rv;
+}
+
+
+/* name for base.sfx not yet issued, in fname (OUT_NAMESZ bytes) */
+static void names_pick(out_names_t *on, char *fname, char *base, char *sfx)
+{
+	out_ent_t *ent;
+	int i;
+
+	snprintf(fname, OUT_NAMESZ, "%s.%s", base, sfx);
+	if (!(ent = names_find(on, fname)))
+		return;
+
+	for (i = ent->oe_seq; ; i++) {
+		snprintf(fname, OUT_NAMESZ, "%s.%d.%s", base, i, sfx);
+		if (!names_find(on, fname))
+			break;
+	}
+	ent->oe_seq = i + 1;
+}
+
+
+/* remove file made by an earlier run, so that its name can be reused */
+void out_remove(tsb_ctx_t *tsb, char *path)
+{
+	out_names_t *on = tsb->ts_names;
+	out_ent_t *ent, **hp;
+
+	if (unlink(path) < 0 && errno != ENOENT) {
+		perror(path);
+		return;
+	}
+	if (!on)
+		return;
+
+	for (hp = &on->on_hash[on_hash(path) & (on->on_hashsz - 1)];
+	     (ent = *hp); hp = &ent->oe_next)
+		if (strcmp(ent->oe_path, path) == 0) {
+			*hp = ent->oe_next;
+			free(ent->oe_path);
+			free(ent);
+			on->on_count--;
+			break;
+		}
+}
+
+
+/* release names registered by out_open for this tape */
+void out_fini(tsb_ctx_t *tsb)
+{
+	out_names_t *on = tsb->ts_names;
+	out_ent_t *ent, *next;
+	int i;
+
+	if (!on)
+		return;
+	for (i = 0; i < on->on_hashsz; i++)
+		for (ent = on->on_hash[i]; ent; ent = next) {
+			next = ent->oe_next;
+			free(ent->oe_path);
+			free(ent);
+		}
+	free(on->on_hash);
+	free(on);
+	tsb->ts_names = NULL;
+}
+
+
+/* returns -1 if name doesn't fit in header */
+static int tar_header(out_arch_t *ar)
+{
+	unsigned char hdr[TAR_BLOCKSZ];
+	char *name = ar->oa_name, *sp;
+	int i, len = strlen(name);
+	unsigned sum = 0;
+
+	memset(hdr, 0, sizeof hdr);
+
+	/* long names are split at a '/' into prefix and name */
+	if (len > 100) {
+		for (sp = name + len - 101; (sp = strchr(sp+1, '/')); )
+			if (sp - name <= 155)
+				break;
+		if (!sp || sp - name > 155)
+			return -1;
+		memcpy(hdr+345, name, sp - name);
+		name = sp+1;
+	}
+	memcpy(hdr, name, strlen(name));
+
+	sprintf((char *) hdr+100, "%07o", 0644);		/* mode */
+	sprintf((char *) hdr+108, "%07o", 0);		/* uid */
+	sprintf((char *) hdr+116, "%07o", 0);		/* gid */
+	sprintf((char *) hdr+124, "%011lo", (unsigned long) ar->oa_datalen);
+	sprintf((char *) hdr+136, "%011lo", (unsigned long)
+		(ar->oa_mtime < 0 ? time(NULL) : ar->oa_mtime));
+	hdr[156] = '0';					/* regular file */
+	memcpy(hdr+257, "ustar", 6);
+	memcpy(hdr+263, "00", 2);
+
+	memset(hdr+148, ' ', 8);
+	for (i = 0; i < TAR_BLOCKSZ; i++)
+		sum += hdr[i];
+	sprintf((char *) hdr+148, "%06o", sum);
+
+	fwrite(hdr, 1, TAR_BLOCKSZ, ar->oa_fp);
+	return 0;
+}
+
+
+/* entry date as YYYY-MM-DD, "-" if not known; date has 16 bytes */
+static void arch_date(out_arch_t *ar, char *date)
+{
+	struct tm tm;
+
+	strcpy(date, "-");
+	if (ar->oa_mtime >= 0 && localtime_r(&ar->oa_mtime, &tm))
+		strftime(date, 16, "%Y-%m-%d", &tm);
+}
+
+
+/*
+ * -H frame: a line "TSB uid=C903 name=HELLO type=bas size=259
+ * date=1975-04-10" (date=- if not known), then exactly size bytes.
+ */
+static void frame_header(out_arch_t *ar)
+{
+	char *uid = "-", *name = ar->oa_name, *sp;
+	char date[16];
+	int uidlen = 1;
+
+	if ((sp = strrchr(name, '/'))) {
+		uid = name;
+		uidlen = sp - name;
+		name = sp+1;
+	}
+	arch_date(ar, date);
+
+	fprintf(ar->oa_fp, "TSB uid=%.*s name=%s type=%s size=%lu date=%s\n",
+		uidlen, uid, name, ar->oa_sfx, (unsigned long) ar->oa_datalen,
+		date);
+}
+
+
+/*
+ * returns 1 if file at path holds data, 0 if no file, -1 if it differs,
+ * -2 if it can't be read
+ */
+static int store_same(char *path, char *data, size_t len)
+{
+	char buf[8192];
+	FILE *fp;
+	size_t n;
+	int rv = 1;
+
+	if (!(fp = fopen(path, "r"))) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -2;
+	}
+	while (rv > 0 && (n = fread(buf, 1, sizeof buf, fp)) > 0) {
+		if (n > len || memcmp(buf, data, n) != 0)
+			rv = -1;
+		data += n;
+		len -= n;
+	}
+	if (ferror(fp)) {
+		perror(path);
+		rv = -2;
+	} else if (len)
+		rv = -1;
+	fclose(fp);
+	return rv;
+}
+
+
+/* write data to new file path; returns -1 if error, 0 if path exists */
+static int store_write(char *path, char *data, size_t len)
+{
+	char tmp[OUT_NAMESZ + 8];
+	int fd, rv = 1;
+
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0) {
+		perror(tmp);
+		return -1;
+	}
+	if (write(fd, data, len) != (ssize_t) len || close(fd) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	/* unlike rename, link won't replace an object stored meanwhile */
+	if (link(tmp, path) < 0) {
+		rv = errno == EEXIST ? 0 : -1;
+		if (rv < 0)
+			perror(path);
+	}
+	unlink(tmp);
+	return rv;
+}
+
+
+/*
+ * -C: store entry as an object named by the 64-bit FNV-1a hash of its
+ * contents, e.g. "3f/a2...", unless an identical one is already there,
+ * and add a line "object size date name" to the manifest. An object
+ * whose hash matches but whose contents don't gets "-1", "-2", ...
+ * (up to STORE_MAXSFX) appended to its name.
+ */
+/* returns -1 if error */
+static int store_entry(out_arch_t *ar)
+{
+	char path[OUT_NAMESZ], obj[32], date[16];
+	uint64_t hash;
+	SINK *snp;
+	int i, rv;
+
+	if (!(snp = sink_inithash())) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	sink_write(snp, ar->oa_data, ar->oa_datalen);
+	hash = sink_hashval(snp);
+	sink_fini(snp);
+
+	for (i = 0; ; ) {
+		sprintf(obj, "%02x/%014" PRIx64, (unsigned) (hash >> 56),
+			hash & 0xffffffffffffffULL);
+		if (i)
+			sprintf(obj + strlen(obj), "-%d", i);
+
+		snprintf(path, sizeof path, "%s/%.2s", ar->oa_store, obj);
+		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+			perror(path);
+			return -1;
+		}
+		snprintf(path, sizeof path, "%s/%s", ar->oa_store, obj);
+
+		rv = store_same(path, ar->oa_data, ar->oa_datalen);
+		if (rv > 0)
 			break;
+		if (rv == -2)
+			return -1;
+		if (rv < 0) {		/* hash collision */
+			if (++i > STORE_MAXSFX) {
+				fprintf(stderr, "%s: too many objects with "
+					"the same hash\n", path);
+				return -1;
+			}
+			continue;
 		}
-		if (errno != EEXIST) {
-			perror(fname);
+		rv = store_write(path, ar->oa_data, ar->oa_datalen);
+		if (rv < 0)
+			return -1;
+		if (rv > 0)
 			break;
+		/* else stored meanwhile: check it */
+	}
+
+	arch_date(ar, date);
+	fprintf(ar->oa_fp, "%s\t%lu\t%s\t%s\n", obj,
+		(unsigned long) ar->oa_datalen, date, ar->oa_name);
+	return 0;
+}
+
+
+/* write pending entry; an error is also kept in oa_err */
+/* returns -1 if error */
+static int arch_flush(out_arch_t *ar)
+{
+	static const char zero[TAR_BLOCKSZ];
+	int pad, rv = 0;
+
+	if (!ar->oa_pending)
+		return 0;
+
+	/* write errors on oa_fp are caught by ferror in out_arch_close */
+	if (ar->oa_format == ARCH_STORE)
+		rv = store_entry(ar);
+	else if (ar->oa_format == ARCH_FRAME) {
+		frame_header(ar);
+		fwrite(ar->oa_data, 1, ar->oa_datalen, ar->oa_fp);
+	} else if (tar_header(ar) < 0) {
+		fprintf(stderr, "%s: name too long for archive\n",
+			ar->oa_name);
+		rv = -1;
+	} else {
+		fwrite(ar->oa_data, 1, ar->oa_datalen, ar->oa_fp);
+		pad = -ar->oa_datalen & (TAR_BLOCKSZ - 1);
+		fwrite(zero, 1, pad, ar->oa_fp);
+	}
+
+	free(ar->oa_name);
+	free(ar->oa_data);
+	ar->oa_name = ar->oa_data = NULL;
+	ar->oa_pending = 0;
+	if (rv < 0)
+		ar->oa_err = 1;
+	return rv;
+}
+
+
+/* format is ARCH_*; path "-" is stdout; for ARCH_STORE, path is manifest */
+/* returns -1 if error */
+int out_arch_open(tsb_ctx_t *tsb, char *path, int format, char *store)
+{
+	out_arch_t *ar;
+
+	if (store && mkdir(store, 0777) < 0 && errno != EEXIST) {
+		perror(store);
+		return -1;
+	}
+	if (!(ar = calloc(1, sizeof(out_arch_t)))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	ar->oa_path = path;
+	ar->oa_format = format;
+	ar->oa_store = store;
+	if (strcmp(path, "-") == 0)
+		ar->oa_fp = stdout;
+	else if (!(ar->oa_fp = fopen(path, "w"))) {
+		perror(path);
+		free(ar);
+		return -1;
+	}
+	tsb->ts_arch = ar;
+	return 0;
+}
+
+
+/* write last entry and end of archive */
+/* returns -1 if error, including any entry that couldn't be written */
+int out_arch_close(tsb_ctx_t *tsb)
+{
+	static const char zero[2 * TAR_BLOCKSZ];
+	out_arch_t *ar = tsb->ts_arch;
+	int rv = 0;
+
+	(void) arch_flush(ar);
+	if (ar->oa_err)
+		rv = -1;
+	if (ar->oa_format == ARCH_TAR)
+		fwrite(zero, 1, sizeof zero, ar->oa_fp);
+
+	/* any failed write of an entry, header or manifest line */
+	if (fflush(ar->oa_fp) != 0 || ferror(ar->oa_fp)) {
+		perror(ar->oa_path);
+		rv = -1;
+	}
+	if (ar->oa_fp != stdout)
+		fclose(ar->oa_fp);
+	free(ar);
+	tsb->ts_arch = NULL;
+	return rv;
+}
+
+
+/* actual file name (OUT_NAMESZ bytes) returned in fname */
+SINK *out_open(tsb_ctx_t *tsb, char *name, char *sfx, char *fname)
+{
+	char base[OUT_NAMESZ];
+	char *dir = tsb->ts_outdir ? tsb->ts_outdir : "";
+	char *sep = tsb->ts_outdir ? "/" : "";
+	out_names_t *on;
+	FILE *fp;
+	SINK *rv = NULL;
+
+	if (tsb->ts_sout && !tsb->ts_arch) {
+		fname[0] = '\0';
+		msg_snp = sink_initf(out_msgf(tsb));
+		return msg_snp;
+	}
+
+	snprintf(fname, OUT_NAMESZ, "%s%s%s.%s", dir, sep, name, sfx);
+
+	/* name is chosen when committed; fname is only for messages */
+	if (defer) {
+		fflush(defer->od_msgfp);
+		defer->od_msgoff = defer->od_msglen;
+		defer->od_name = strdup(name);
+		defer->od_sfx = sfx;
+		defer->od_fp = open_memstream(&defer->od_data,
+					      &defer->od_datalen);
+		if (!defer->od_name || !defer->od_fp ||
+		    !(rv = sink_initf(defer->od_fp))) {
+			fprintf(stderr, "Out of memory\n");
+			if (defer->od_fp)
+				fclose(defer->od_fp);
+			defer->od_fp = NULL;
+			defer->od_msgoff = -1;
+		}
+		return rv;
+	}
+
+	/* registry is only touched by the thread committing output */
+	if (!(on = tsb->ts_names)) {
+		on = calloc(1, sizeof(out_names_t));
+		if (on)
+			on->on_hash = calloc(on->on_hashsz = 64,
+					     sizeof(out_ent_t *));
+		if (!on || !on->on_hash) {
+			fprintf(stderr, "Out of memory\n");
+			free(on);
+			return NULL;
+		}
+		tsb->ts_names = on;
+	}
+
+	/* archive: names need only be unique within it; frames are as is */
+	if (tsb->ts_arch) {
+		out_arch_t *ar = tsb->ts_arch;
+
+		/* previous file: an error is kept for out_arch_close */
+		(void) arch_flush(ar);
+		if (ar->oa_format == ARCH_FRAME)
+			snprintf(fname, OUT_NAMESZ, "%s", name);
+		else
+			names_pick(on, fname, name, sfx);
+		if (names_add(on, fname) < 0 ||
+		    !(ar->oa_name = strdup(fname)) ||
+		    !(rv = sink_initmem(&ar->oa_data, &ar->oa_datalen))) {
+			fprintf(stderr, "Out of memory\n");
+			free(ar->oa_name);
+			ar->oa_name = NULL;
+			return NULL;
 		}
-		sprintf(fname, "%s.%d.%s", name, i+1, sfx);
+		if (ar->oa_format == ARCH_TAR)
+			fprintf(tsb->ts_out, "Extracting to %s\n", fname);
+		ar->oa_sfx = sfx;
+		ar->oa_mtime = -1;
+		ar->oa_snp = rv;
+		return rv;
 	}
 
-	if (fp) {
-		if (!(rv = sink_initf(fp))) {
+	/* ensure subdirectories exist */
+	if (make_dirs(on, fname) < 0)
+		return NULL;
+
+	/* "wx" only fails if something else made the file meanwhile */
+	snprintf(base, sizeof base, "%s%s%s", dir, sep, name);
+	do {
+		names_pick(on, fname, base, sfx);
+		if (names_add(on, fname) < 0) {
 			fprintf(stderr, "Out of memory\n");
-			fclose(fp);
+			return NULL;
 		}
+		fp = fopen(fname, "wx");
+	} while (!fp && errno == EEXIST);
+
+	if (!fp) {
+		perror(fname);
+		return NULL;
+	}
+	fprintf(tsb->ts_out, "Extracting to %s\n", fname);
+
+	/* -I notes where the file went */
+	if (tsb->ts_state) {
+		free(tsb->ts_outname);
+		tsb->ts_outname = strdup(fname);
+	}
+
+	if (!(rv = sink_initf(fp))) {
+		fprintf(stderr, "Out of memory\n");
+		fclose(fp);
 	}
 
 	return rv;
 }
 
 
-void out_close(SINK *snp)
+/* returns -1 if the output could not all be written */
+int out_close(tsb_ctx_t *tsb, SINK *snp)
 {
-	FILE *fp = sink_getf(snp);
+	out_arch_t *ar = tsb->ts_arch;
+	FILE *fp;
+	int rv = 0;
 
-	if (fp != stdout)
-		fclose(fp);
-	sink_fini(snp);
+	/* archive entry is written when the next file is opened */
+	if (ar && snp == ar->oa_snp) {
+		rv = sink_fini(snp);
+		ar->oa_snp = NULL;
+		ar->oa_pending = 1;
+		return rv < 0 ? -1 : 0;
+	}
+
+	fp = sink_getf(snp);
+
+	/* -O sink shares the stream for messages */
+	if (snp == msg_snp) {
+		msg_snp = NULL;
+		if (fflush(fp) != 0)
+			rv = -1;
+	} else if (fclose(fp) != 0)
+		rv = -1;
+	if (defer && fp == defer->od_fp)
+		defer->od_fp = NULL;
+	if (sink_fini(snp) < 0)
+		rv = -1;
+	return rv;
+}
+
+
+/* returns stream for messages about the file being extracted */
+FILE *out_msgf(tsb_ctx_t *tsb)
+{
+	/* keep messages in order with buffered output */
+	if (msg_snp)
+		(void) sink_getf(msg_snp);
+	return defer ? defer->od_msgfp : tsb->ts_out;
+}
+
+
+/*
+ * Collect this thread's output in memory, to be written later by
+ * out_defer_commit. Messages go to a buffer instead of ts_out;
+ * out_open records the requested name and returns a sink writing to
+ * another buffer, deferring the choice of a unique file name (and the
+ * "Extracting to" message) until the output is committed. Worker threads
+ * use this so that files extracted in parallel are named, and messages
+ * printed, just as if they had been extracted one by one.
+ */
+/* returns -1 if out of memory */
+int out_defer_begin(out_defer_t *od)
+{
+	memset(od, 0, sizeof(out_defer_t));
+	od->od_msgoff = -1;
+	od->od_msgfp = open_memstream(&od->od_msg, &od->od_msglen);
+	if (!od->od_msgfp)
+		return -1;
+	defer = od;
+	return 0;
+}
+
+
+void out_defer_end(out_defer_t *od)
+{
+	if (od->od_fp) {
+		fclose(od->od_fp);
+		od->od_fp = NULL;
+	}
+	fclose(od->od_msgfp);
+	od->od_msgfp = NULL;
+	defer = NULL;
+}
+
+
+/* write output collected by out_defer_begin/out_defer_end, then free it */
+/* returns -1 if file could not be created or written */
+int out_defer_commit(tsb_ctx_t *tsb, out_defer_t *od)
+{
+	char fname[OUT_NAMESZ];
+	SINK *snp;
+	size_t nbefore = od->od_msglen;
+	int rv = 0;
+
+	if (od->od_msgoff >= 0)
+		nbefore = od->od_msgoff;
+	fwrite(od->od_msg, 1, nbefore, tsb->ts_out);
+
+	if (od->od_msgoff >= 0) {
+		snp = out_open(tsb, od->od_name, od->od_sfx, fname);
+		if (snp) {
+			sink_write(snp, od->od_data, od->od_datalen);
+			if (out_close(tsb, snp) < 0) {
+				fprintf(tsb->ts_out, "%s: error writing "
+					"output\n", od->od_name);
+				rv = -1;
+			}
+			if (od->od_mtime)
+				set_mtime(tsb, fname, &od->od_tm);
+		} else {
+			/* extraction would have stopped here */
+			nbefore = od->od_msglen;
+			rv = -1;
+		}
+	}
+	fwrite(od->od_msg + nbefore, 1, od->od_msglen - nbefore, tsb->ts_out);
+
+	/* -O output went out with the messages */
+	if (tsb->ts_sout && !tsb->ts_arch && fflush(tsb->ts_out) != 0)
+		rv = -1;
+
+	free(od->od_msg);
+	free(od->od_data);
+	free(od->od_name);
+	memset(od, 0, sizeof(out_defer_t));
+	return rv;
 }
@@ -22,12 +22,43 @@
 #ifndef _OUTFILE_H
 #define _OUTFILE_H 1
 
-extern int sout;
+#define OUT_NAMESZ	1024	/* size of fname for out_open */
 
-extern SINK *out_open(char *name, char *sfx, char *fname);
-extern void out_close(SINK *snp);
+#define ARCH_TAR	0	/* -o: tar archive */
+#define ARCH_FRAME	1	/* -H: framed files on stdout */
+#define ARCH_STORE	2	/* -C: content-addressed store and manifest */
+
+struct tsb_ctx;
+
+/* output of one extraction, collected for writing later */
+typedef struct {
+	FILE		*od_msgfp;	/* messages */
+	char		*od_msg;
+	size_t		od_msglen;
+	ssize_t		od_msgoff;	/* length of od_msg at out_open, or -1 */
+	char		*od_name;	/* as passed to out_open */
+	char		*od_sfx;
+	FILE		*od_fp;		/* file contents */
+	char		*od_data;
+	size_t		od_datalen;
+	int		od_mtime;	/* od_tm valid */
+	struct tm	od_tm;
+} out_defer_t;
+
+extern SINK *out_open(struct tsb_ctx *tsb, char *name, char *sfx,
+		      char *fname);
+extern int out_close(struct tsb_ctx *tsb, SINK *snp);
+extern void out_fini(struct tsb_ctx *tsb);
+extern void out_remove(struct tsb_ctx *tsb, char *path);
+extern int out_arch_open(struct tsb_ctx *tsb, char *path, int format,
+			 char *store);
+extern int out_arch_close(struct tsb_ctx *tsb);
+extern FILE *out_msgf(struct tsb_ctx *tsb);
+extern int out_defer_begin(out_defer_t *od);
+extern void out_defer_end(out_defer_t *od);
+extern int out_defer_commit(struct tsb_ctx *tsb, out_defer_t *od);
 extern char *name_match(char *pattern, char *id, char *name);
 extern int jdate_to_tm(int yr, int jday, struct tm *tm);
-extern void set_mtime(char *fname, struct tm *tm);
+extern void set_mtime(struct tsb_ctx *tsb, char *fname, struct tm *tm);
 
 #endif /* _OUTFILE_H */
@@ -24,6 +24,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "simtap.h"
 #include "sink.h"
 #include "tsbtap.h"
@@ -33,6 +36,12 @@
 
 /* tp_status bits */
 #define	TP_WRITE	0x1
+#define	TP_MAP		0x2
+#define	TP_PEEK		0x4	/* header of next block is in tp_nbytes */
+#define	TP_VIEW		0x8	/* tp_map belongs to another TAPE */
+
+/* errors in a view were reported when the whole image was read */
+#define	QUIET(tap)	((tap)->tp_status & TP_VIEW)
 #define	TP_ERR		0x40
 #define	TP_EOM		0x80
 
@@ -41,6 +50,7 @@ TAPE *tap_open(char *path, int is_write)
 {
 	FILE *fp;
 	TAPE *rv;
+	struct stat st;
 	char *mode = is_write ? "w" : "r";
 
 	fp = fopen(path, mode);
@@ -48,21 +58,83 @@ TAPE *tap_open(char *path, int is_write)
 		return NULL;
 
 	rv = (TAPE *)malloc(sizeof(TAPE));
-	if (rv) {
-		rv->tp_fp = fp;
-		rv->tp_path = path;
-		rv->tp_buf = NULL;
-		rv->tp_nbytes = 0;
-		rv->tp_status = is_write ? TP_WRITE : 0;
+	if (!rv) {
+		fclose(fp);
+		return NULL;
+	}
+	memset(rv, 0, sizeof(TAPE));
+	rv->tp_fp = fp;
+	rv->tp_path = path;
+	rv->tp_status = is_write ? TP_WRITE : 0;
+
+	/*
+	 * Map regular files for reading, so that blocks can be returned
+	 * in place. Callers may modify a block (e.g. TSB label when
+	 * converting), so the mapping is copy-on-write. Pipes etc. are
+	 * read via stdio.
+	 */
+	if (!is_write && fstat(fileno(fp), &st) == 0 &&
+	    S_ISREG(st.st_mode) && st.st_size > 0) {
+		rv->tp_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE, fileno(fp), 0);
+		if (rv->tp_map == MAP_FAILED) {
+			dprint(("%s: tap_open: mmap failed, using stdio\n",
+				path));
+			rv->tp_map = NULL;
+		} else {
+			(void) madvise(rv->tp_map, st.st_size,
+				       MADV_SEQUENTIAL);
+			rv->tp_mapsz = st.st_size;
+			rv->tp_status |= TP_MAP;
+		}
 	}
 
 	return rv;
 }
 
 
+/*
+ * Open a read-only view of part of a mapped tape image, from offset
+ * off up to end. The view shares the mapping (and so must be closed
+ * before tap), but has its own read position, so that it may be read
+ * by another thread. tap must already have been read past end, so
+ * errors in the view's blocks are not reported again.
+ */
+/* returns NULL if tap is not mapped, or out of memory */
+TAPE *tap_openview(TAPE *tap, off_t off, off_t end)
+{
+	TAPE *rv;
+
+	if (!(tap->tp_status & TP_MAP) || off < 0 || off > end ||
+	    end > tap->tp_mapsz)
+		return NULL;
+
+	rv = (TAPE *)malloc(sizeof(TAPE));
+	if (!rv)
+		return NULL;
+	memset(rv, 0, sizeof(TAPE));
+	rv->tp_path = tap->tp_path;
+	rv->tp_status = TP_MAP | TP_VIEW;
+	rv->tp_map = tap->tp_map;
+	rv->tp_mapsz = end;
+	rv->tp_off = off;
+
+	return rv;
+}
+
+
+int tap_is_mapped(TAPE *tap)
+{
+	return tap->tp_status & TP_MAP;
+}
+
+
 void tap_close(TAPE *tap)
 {
-	fclose(tap->tp_fp);
+	if (tap->tp_fp)
+		fclose(tap->tp_fp);
+	if (tap->tp_map && !(tap->tp_status & TP_VIEW))
+		munmap(tap->tp_map, tap->tp_mapsz);
 	if (tap->tp_buf)
 		free(tap->tp_buf);
 	memset(tap, 0, sizeof(TAPE));
@@ -76,66 +148,168 @@ int tap_is_write(TAPE *tap)
 }
 
 
-/* Read next tape block */
-/* returns block size, -1=end of tape, -2=error, e.g. out of memory */
-ssize_t tap_readblock(TAPE *tap, char **bufp)
+/* returns current read position in tape image */
+off_t tap_tell(TAPE *tap)
 {
-	unsigned char sbuf[4];
-	size_t rv;
+	if (tap->tp_status & TP_MAP)
+		return tap->tp_off;
+	return ftello(tap->tp_fp);
+}
 
-	*bufp = NULL;
 
+/* set read position in tape image, e.g. from an index */
+/* returns 0 on success, -1 if error */
+int tap_seek(TAPE *tap, off_t off)
+{
 	if (tap->tp_status & TP_WRITE) {
-		fprintf(stderr,
-			"%s: tap_readblock not allowed while writing tape",
+		fprintf(stderr, "%s: tap_seek not allowed while writing tape",
 			tap->tp_path);
-		return -2;
+		return -1;
 	}
 
-	if (tap->tp_status & TP_ERR)
-		return -2;
-
-	if (tap->tp_status & TP_EOM)
+	if (tap->tp_status & TP_MAP) {
+		if (off < 0 || off > tap->tp_mapsz)
+			return -1;
+		tap->tp_off = off;
+	} else if (fseeko(tap->tp_fp, off, SEEK_SET) < 0)
 		return -1;
 
-	/* read header */
-	rv = fread(sbuf, 1, 4, tap->tp_fp);
-	if (rv < 4) {
+	tap->tp_status &= ~(TP_EOM | TP_ERR | TP_PEEK);
+	return 0;
+}
+
+
+/* Read next tape block from mapped image, validating it in place */
+/* returns as for tap_readblock */
+static ssize_t map_readblock(TAPE *tap, char **bufp)
+{
+	unsigned char *bp;
+	off_t off = tap->tp_off;
+	off_t nleft = tap->tp_mapsz - off;
+
+	/* header */
+	if (nleft < 4) {
 		dprint(("%s: tap_readblock: EOF reading header at 0x%lx\n",
-			tap->tp_path, ftell(tap->tp_fp) - rv));
+			tap->tp_path, off));
+		tap->tp_off = tap->tp_mapsz;
 		tap->tp_status |= TP_EOM;
 		return -1;
 	}
-	tap->tp_nbytes = LE32(sbuf);
+	bp = (unsigned char *) tap->tp_map + off;
+	tap->tp_nbytes = LE32(bp);
+	off += 4;
+	nleft -= 4;
+	tap->tp_off = off;
 	if (tap->tp_nbytes == 0xffffffff) {
 		dprint(("%s: tap_readblock: end-of-medium marker at 0x%lx\n",
-			tap->tp_path, ftell(tap->tp_fp) - 4));
+			tap->tp_path, off - 4));
 		tap->tp_status |= TP_EOM;
 		return -1;
 	}
 
-	/* Empty tape block indicates tapemark. No data or trailer to read */
+	/* Empty tape block indicates tapemark. No data or trailer */
 	if (tap->tp_nbytes == 0)
 		return 0;
 
-	/* read data */
-	tap->tp_buf = realloc(tap->tp_buf, tap->tp_nbytes);
-	if (!tap->tp_buf) {
-		fprintf(stderr, "%s: block size %u too large, offset 0x%lx\n",
-			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp) - 4);
+	/* data */
+	if (tap->tp_nbytes > nleft) {
+		if (!QUIET(tap))
+			fprintf(stderr, "%s: EOF reading %u bytes, "
+					"offset 0x%lx\n",
+				tap->tp_path, tap->tp_nbytes, off);
+		tap->tp_off = tap->tp_mapsz;
 		tap->tp_status |= TP_ERR;
 		return -2;
 	}
-	rv = fread(tap->tp_buf, 1, tap->tp_nbytes, tap->tp_fp);
-	if (rv != tap->tp_nbytes) {
-		fprintf(stderr, "%s: EOF reading %u bytes, offset 0x%lx\n",
-			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp) - rv);
+	*bufp = tap->tp_map + off;
+	off += tap->tp_nbytes;
+	nleft -= tap->tp_nbytes;
+
+	/* trailer */
+	if (nleft < 4) {
+		if (!QUIET(tap))
+			fprintf(stderr, "%s: EOF reading trailer at "
+					"offset 0x%lx\n",
+				tap->tp_path, off + nleft - 4);
+		tap->tp_off = tap->tp_mapsz;
+		tap->tp_status |= TP_EOM;
+		return tap->tp_nbytes;
+	}
+	bp = (unsigned char *) tap->tp_map + off;
+	if (tap->tp_nbytes & 1) {
+		/* Some tape images omit the required even-byte padding. */
+		if (tap->tp_nbytes == LE32(bp)) {
+			dprint(("%s: tap_readblock: no padding at 0x%lx\n",
+				tap->tp_path, off));
+			tap->tp_off = off + 4;
+			return tap->tp_nbytes;
+		}
+
+		/* Conforming image: skip over padding byte. */
+		if (nleft < 5) {
+			if (!QUIET(tap))
+				fprintf(stderr,
+					"%s: EOF reading trailer, "
+					"offset 0x%lx\n",
+					tap->tp_path, off + 3);
+			tap->tp_off = tap->tp_mapsz;
+			tap->tp_status |= TP_EOM;
+			return tap->tp_nbytes;
+		}
+		bp++;
+		off++;
+	}
+	tap->tp_off = off + 4;
+	if (tap->tp_nbytes != LE32(bp)) {
+		if (!QUIET(tap))
+			fprintf(stderr, "%s: trailer size %u (offset 0x%lx) "
+					"doesn't match header size %u\n",
+				tap->tp_path, LE32(bp), off, tap->tp_nbytes);
 		tap->tp_status |= TP_ERR;
-		return -2;
 	}
-	*bufp = tap->tp_buf;
 
-	/* read trailer */
+	return tap->tp_nbytes;
+}
+
+
+/* Read header of next block from file into tp_nbytes */
+/* returns 0 if OK, -1 if end of tape */
+static int file_readhdr(TAPE *tap)
+{
+	unsigned char sbuf[4];
+	size_t rv;
+
+	/* already read by tap_peekblock? */
+	if (tap->tp_status & TP_PEEK) {
+		tap->tp_status &= ~TP_PEEK;
+		return 0;
+	}
+
+	rv = fread(sbuf, 1, 4, tap->tp_fp);
+	if (rv < 4) {
+		dprint(("%s: tap_readblock: EOF reading header at 0x%lx\n",
+			tap->tp_path, ftell(tap->tp_fp) - rv));
+		tap->tp_status |= TP_EOM;
+		return -1;
+	}
+	tap->tp_nbytes = LE32(sbuf);
+	if (tap->tp_nbytes == 0xffffffff) {
+		dprint(("%s: tap_readblock: end-of-medium marker at 0x%lx\n",
+			tap->tp_path, ftell(tap->tp_fp) - 4));
+		tap->tp_status |= TP_EOM;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Read trailer (and padding) of block from file, after its data */
+/* returns block size */
+static ssize_t file_readtrailer(TAPE *tap)
+{
+	unsigned char sbuf[4];
+	size_t rv;
+
 	rv = fread(sbuf, 1, 4, tap->tp_fp);
 	if (rv < 4) {
 		fprintf(stderr, "%s: EOF reading trailer at offset 0x%lx\n",
@@ -174,6 +348,149 @@ ssize_t tap_readblock(TAPE *tap, char **bufp)
 }
 
 
+/* returns 0 if tape may be read, else value for tap_readblock to return */
+static ssize_t read_ok(TAPE *tap, char *fn)
+{
+	if (tap->tp_status & TP_WRITE) {
+		fprintf(stderr,
+			"%s: %s not allowed while writing tape",
+			tap->tp_path, fn);
+		return -2;
+	}
+
+	if (tap->tp_status & TP_ERR)
+		return -2;
+
+	if (tap->tp_status & TP_EOM)
+		return -1;
+
+	return 0;
+}
+
+
+/* Read next tape block */
+/* returns block size, -1=end of tape, -2=error, e.g. out of memory */
+ssize_t tap_readblock(TAPE *tap, char **bufp)
+{
+	ssize_t st;
+	size_t rv;
+
+	*bufp = NULL;
+
+	if (st = read_ok(tap, "tap_readblock"))
+		return st;
+
+	/* mapped image: no copy */
+	if (tap->tp_status & TP_MAP)
+		return map_readblock(tap, bufp);
+
+	/* read header */
+	if (file_readhdr(tap) < 0)
+		return -1;
+
+	/* Empty tape block indicates tapemark. No data or trailer to read */
+	if (tap->tp_nbytes == 0)
+		return 0;
+
+	/* read data */
+	tap->tp_buf = realloc(tap->tp_buf, tap->tp_nbytes);
+	if (!tap->tp_buf) {
+		fprintf(stderr, "%s: block size %u too large, offset 0x%lx\n",
+			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp) - 4);
+		tap->tp_status |= TP_ERR;
+		return -2;
+	}
+	rv = fread(tap->tp_buf, 1, tap->tp_nbytes, tap->tp_fp);
+	if (rv != tap->tp_nbytes) {
+		fprintf(stderr, "%s: EOF reading %u bytes, offset 0x%lx\n",
+			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp) - rv);
+		tap->tp_status |= TP_ERR;
+		return -2;
+	}
+	*bufp = tap->tp_buf;
+
+	/* read trailer */
+	return file_readtrailer(tap);
+}
+
+
+/* Get size of next tape block without moving past it */
+/* returns as for tap_readblock */
+ssize_t tap_peekblock(TAPE *tap)
+{
+	unsigned char *bp;
+	ssize_t rv;
+
+	if (rv = read_ok(tap, "tap_peekblock"))
+		return rv;
+
+	/* mapped image: errors are reported when block is read */
+	if (tap->tp_status & TP_MAP) {
+		if (tap->tp_mapsz - tap->tp_off < 4)
+			return -1;
+		bp = (unsigned char *) tap->tp_map + tap->tp_off;
+		rv = (uint32_t) LE32(bp);
+		return rv == 0xffffffff ? -1 : rv;
+	}
+
+	if (!(tap->tp_status & TP_PEEK)) {
+		if (file_readhdr(tap) < 0)
+			return -1;
+		tap->tp_status |= TP_PEEK;
+	}
+	return tap->tp_nbytes;
+}
+
+
+/* Move past next tape block, reading only its header and trailer */
+/* check: verify trailer of even-sized blocks, too */
+/* returns as for tap_readblock */
+ssize_t tap_skipblock(TAPE *tap, int check)
+{
+	char buf[4096], *unused;
+	ssize_t st;
+	off_t n;
+	size_t rv;
+
+	if (st = read_ok(tap, "tap_skipblock"))
+		return st;
+
+	/* mapped image: validating in place costs nothing */
+	if (tap->tp_status & TP_MAP)
+		return map_readblock(tap, &unused);
+
+	if (file_readhdr(tap) < 0)
+		return -1;
+	if (tap->tp_nbytes == 0)
+		return 0;
+
+	/* seek over data; read and discard if not seekable */
+	if (fseeko(tap->tp_fp, tap->tp_nbytes, SEEK_CUR) < 0) {
+		for (n = tap->tp_nbytes; n > 0; n -= rv) {
+			rv = fread(buf, 1, MIN(n, sizeof buf), tap->tp_fp);
+			if (rv == 0) {
+				fprintf(stderr, "%s: EOF reading %u bytes, "
+						"offset 0x%lx\n",
+					tap->tp_path, tap->tp_nbytes,
+					ftell(tap->tp_fp) -
+					    (tap->tp_nbytes - n));
+				tap->tp_status |= TP_ERR;
+				return -2;
+			}
+		}
+	}
+
+	/* odd size: must look at trailer to find padding */
+	if (check || (tap->tp_nbytes & 1))
+		return file_readtrailer(tap);
+
+	if (fseeko(tap->tp_fp, 4, SEEK_CUR) < 0 &&
+	    fread(buf, 1, 4, tap->tp_fp) < 4)
+		tap->tp_status |= TP_EOM;
+	return tap->tp_nbytes;
+}
+
+
 /* Write SIMH-format tape block */
 /* returns bytes written inc. header/trailer, -1 if error */
 ssize_t tap_writeblock(TAPE *tap, char *buf, ssize_t nbytes)
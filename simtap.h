@@ -28,12 +28,21 @@ typedef struct {
 	char		*tp_buf;	/* only for read mode */
 	uint32_t	tp_nbytes;	/* only for read mode */
 	uint8_t		tp_status;
+	char		*tp_map;	/* mapped image, only for read mode */
+	off_t		tp_mapsz;
+	off_t		tp_off;		/* read position in tp_map */
 } TAPE;
 
 extern TAPE *tap_open(char *path, int is_write);
+extern TAPE *tap_openview(TAPE *tap, off_t off, off_t end);
 extern void tap_close(TAPE *tap);
 extern int tap_is_write(TAPE *tap);
+extern int tap_is_mapped(TAPE *tap);
+extern off_t tap_tell(TAPE *tap);
+extern int tap_seek(TAPE *tap, off_t off);
 extern ssize_t tap_readblock(TAPE *tap, char **bufp);
+extern ssize_t tap_peekblock(TAPE *tap);
+extern ssize_t tap_skipblock(TAPE *tap, int check);
 extern ssize_t tap_writeblock(TAPE *tap, char *buf, ssize_t nbytes);
 
 #endif /* _SIMTAP_H */
@@ -16,7 +16,16 @@
  */
 
 /*
- * Routines for using a string or a file as an output sink.
+ * Routines for using a string, a file, growable memory, nothing (output
+ * only counted) or a hash as an output sink.
+ *
+ * A sink has a buffer, snk_buf..snk_end, and the inline routines in
+ * sink.h just copy into it. When it fills, sink_overflow() hands off to
+ * the backend. For a fixed string the buffer is the string itself, and
+ * output that doesn't fit is dropped; the other backends have a private
+ * buffer of SINK_BUFSZ bytes that they drain as it fills. If a drain
+ * fails, the buffer is closed off, so that every later write reaches
+ * sink_overflow() and fails too, and sink_fini() returns -1.
  */
 
 #include <stdio.h>
@@ -27,129 +36,349 @@
 #include "tsbtap.h"
 
 
-SINK *sink_initf(FILE *fp)
+/*
+ * Buffered backends: so_overflow is buf_overflow, which drains the buffer
+ * through so_write. so_write must take all bytes unless there's an error.
+ */
+typedef int (*sink_writefn_t)(SINK *snp, const char *buf, int nbytes);
+
+typedef struct {
+	sink_ops_t	bo_ops;
+	sink_writefn_t	bo_write;
+} buf_ops_t;
+
+static int buf_overflow(SINK *snp, const char *buf, int nbytes);
+static void buf_flush(SINK *snp);
+static int buf_fini(SINK *snp);
+
+
+/* returns number of bytes written, -1 if error */
+static int buf_drain(SINK *snp, const char *buf, int nbytes)
+{
+	int rv;
+
+	if (snp->snk_err)
+		return -1;
+	if (nbytes <= 0)
+		return 0;
+	rv = ((buf_ops_t *) snp->snk_ops)->bo_write(snp, buf, nbytes);
+	if (rv > 0)
+		snp->snk_nwrite += rv;
+	if (rv < nbytes) {
+		/* no more buffering: later writes go to buf_overflow */
+		snp->snk_err = 1;
+		snp->snk_end = snp->snk_buf;
+		return -1;
+	}
+	return rv;
+}
+
+
+static void buf_flush(SINK *snp)
+{
+	buf_drain(snp, snp->snk_buf, snp->snk_bp - snp->snk_buf);
+	snp->snk_bp = snp->snk_buf;
+}
+
+
+static int buf_overflow(SINK *snp, const char *buf, int nbytes)
+{
+	buf_flush(snp);
+	if (snp->snk_err)
+		return -1;
+
+	/* small writes go in the buffer; large ones straight through */
+	if (nbytes <= snp->snk_end - snp->snk_bp) {
+		memcpy(snp->snk_bp, buf, nbytes);
+		snp->snk_bp += nbytes;
+		return nbytes;
+	}
+	return buf_drain(snp, buf, nbytes);
+}
+
+
+static int buf_fini(SINK *snp)
+{
+	buf_flush(snp);
+	return snp->snk_err ? -1 : snp->snk_nwrite;
+}
+
+
+/* returns NULL if out of memory */
+static SINK *buf_init(const buf_ops_t *ops, int bufsz)
 {
 	SINK *rv;
 
-	rv = malloc(sizeof(SINK));
+	rv = malloc(sizeof(SINK) + bufsz);
 	if (rv) {
 		memset(rv, 0, sizeof(SINK));
-		rv->snk_fp = fp;
+		rv->snk_ops = &ops->bo_ops;
+		rv->snk_buf = rv->snk_bp = (char *) (rv + 1);
+		rv->snk_end = rv->snk_buf + bufsz;
 	}
 	return rv;
 }
 
 
-SINK *sink_initstr(char *buf, int nbytes)
+/* file */
+
+static int file_write(SINK *snp, const char *buf, int nbytes)
+{
+	return fwrite(buf, 1, nbytes, snp->snk_fp);
+}
+
+static const buf_ops_t file_ops = {
+	{ buf_overflow, buf_flush, buf_fini }, file_write
+};
+
+
+SINK *sink_initf(FILE *fp)
 {
 	SINK *rv;
 
-	rv = malloc(sizeof(SINK));
+	/* unbuffered when debugging, to keep output in order */
+	rv = buf_init(&file_ops, debug ? 0 : SINK_BUFSZ);
+	if (rv)
+		rv->snk_fp = fp;
+	return rv;
+}
+
+
+/* returns NULL if not a file; pending output is written first */
+FILE *sink_getf(SINK *snp)
+{
+	if (snp->snk_ops != &file_ops.bo_ops)
+		return NULL;
+	buf_flush(snp);
+	return snp->snk_fp;
+}
+
+
+/* growable memory, like open_memstream; *bufp is always NUL-terminated */
+
+static int mem_write(SINK *snp, const char *buf, int nbytes)
+{
+	size_t len = *snp->snk_lenp;
+	char *nbuf;
+
+	nbuf = realloc(*snp->snk_memp, len + nbytes + 1);
+	if (!nbuf)
+		return -1;
+	memcpy(nbuf + len, buf, nbytes);
+	nbuf[len + nbytes] = '\0';
+	*snp->snk_memp = nbuf;
+	*snp->snk_lenp = len + nbytes;
+	return nbytes;
+}
+
+static const buf_ops_t mem_ops = {
+	{ buf_overflow, buf_flush, buf_fini }, mem_write
+};
+
+
+/* *bufp must be freed by the caller after sink_fini */
+SINK *sink_initmem(char **bufp, size_t *lenp)
+{
+	SINK *rv;
+
+	*lenp = 0;
+	*bufp = malloc(1);
+	if (!*bufp)
+		return NULL;
+	**bufp = '\0';
+	rv = buf_init(&mem_ops, SINK_BUFSZ);
 	if (rv) {
-		memset(rv, 0, sizeof(SINK));
-		rv->snk_buf = rv->snk_bp = buf;
-		rv->snk_nleft = nbytes;
+		rv->snk_memp = bufp;
+		rv->snk_lenp = lenp;
+	} else {
+		free(*bufp);
+		*bufp = NULL;
 	}
 	return rv;
 }
 
 
-int sink_printf(SINK *snp, char *fmt, ...)
+/* null: output is only counted */
+
+static int null_write(SINK *snp, const char *buf, int nbytes)
 {
-	va_list ap;
-	int rv;
+	return nbytes;
+}
 
-	/* file */
-	if (snp->snk_fp) {
-		va_start(ap, fmt);
-		rv = vfprintf(snp->snk_fp, fmt, ap);
-		va_end(ap);
-		if (rv > 0)
-			snp->snk_nwrite += rv;
-		return rv;
-	}
+static const buf_ops_t null_ops = {
+	{ buf_overflow, buf_flush, buf_fini }, null_write
+};
 
-	/* string */
-	if (snp->snk_nleft) {
-		va_start(ap, fmt);
-		rv = vsnprintf(snp->snk_bp, snp->snk_nleft, fmt, ap);
-		va_end(ap);
-		rv = MIN(rv, snp->snk_nleft);
-		snp->snk_bp += rv;
-		snp->snk_nleft -= rv;
-		return rv;
-	}
 
-	return 0;
+SINK *sink_initnull(void)
+{
+	return buf_init(&null_ops, SINK_BUFSZ);
 }
 
 
-int sink_write(SINK *snp, char *buf, int nbytes)
+/* hashing: 64-bit FNV-1a of the output */
+
+#define FNV64_BASIS	0xcbf29ce484222325ULL
+#define FNV64_PRIME	0x100000001b3ULL
+
+static int hash_write(SINK *snp, const char *buf, int nbytes)
 {
-	int rv;
+	uint64_t h = snp->snk_hash;
+	int i;
 
-	/* file */
-	if (snp->snk_fp) {
-		rv = fwrite(buf, 1, nbytes, snp->snk_fp);
-		if (rv > 0)
-			snp->snk_nwrite += rv;
-		return rv;
+	for (i = 0; i < nbytes; i++) {
+		h ^= (unsigned char) buf[i];
+		h *= FNV64_PRIME;
 	}
+	snp->snk_hash = h;
+	return nbytes;
+}
 
-	/* string */
-	if (snp->snk_nleft) {
-		rv = MIN(nbytes, snp->snk_nleft);
-		memcpy(snp->snk_bp, buf, rv);
-		snp->snk_bp += rv;
-		snp->snk_nleft -= rv;
-		return rv;
-	}
+static const buf_ops_t hash_ops = {
+	{ buf_overflow, buf_flush, buf_fini }, hash_write
+};
 
-	return 0;
+
+SINK *sink_inithash(void)
+{
+	SINK *rv;
+
+	rv = buf_init(&hash_ops, SINK_BUFSZ);
+	if (rv)
+		rv->snk_hash = FNV64_BASIS;
+	return rv;
 }
 
 
-int sink_putc(int c, SINK *snp)
+/* hash of output so far; 0 if not a hashing sink */
+uint64_t sink_hashval(SINK *snp)
 {
-	int rv;
+	if (snp->snk_ops != &hash_ops.bo_ops)
+		return 0;
+	buf_flush(snp);
+	return snp->snk_hash;
+}
 
-	/* file */
-	if (snp->snk_fp) {
-		rv = putc(c, snp->snk_fp);
-		if (rv > 0)
-			snp->snk_nwrite++;
-		return rv;
-	}
 
-	/* string */
-	if (snp->snk_nleft) {
-		*(snp->snk_bp) = c;
-		snp->snk_bp++;
-		snp->snk_nleft--;
-		return 1;
-	}
+/* fixed string: the buffer is the string, and what doesn't fit is dropped */
+
+static int str_overflow(SINK *snp, const char *buf, int nbytes)
+{
+	int rv = snp->snk_end - snp->snk_bp;
 
-	return 0;
+	memcpy(snp->snk_bp, buf, rv);
+	snp->snk_bp += rv;
+	return rv;
 }
 
+static void str_flush(SINK *snp)
+{
+}
 
-int sink_fini(SINK *snp)
+static int str_fini(SINK *snp)
 {
-	int rv;
+	return snp->snk_bp - snp->snk_buf;
+}
 
-	/* file */
-	if (snp->snk_fp) {
-		rv = snp->snk_nwrite;
+static const sink_ops_t str_ops = { str_overflow, str_flush, str_fini };
 
-	/* string */
-	} else if (snp->snk_buf) {
-		rv = snp->snk_bp - snp->snk_buf;
 
-	/* not initialized? */
-	} else
-		rv = -1;
+/*
+ * Fixed string in a SINK provided by the caller, so a string
+ * sink can be set up and torn down (sink_finiview) without malloc/free.
+ */
+void sink_initview(SINK *snp, char *buf, int nbytes)
+{
+	memset(snp, 0, sizeof(SINK));
+	snp->snk_ops = &str_ops;
+	snp->snk_buf = snp->snk_bp = buf;
+	snp->snk_end = buf + nbytes;
+}
+
+
+SINK *sink_initstr(char *buf, int nbytes)
+{
+	SINK *rv;
+
+	rv = malloc(sizeof(SINK));
+	if (rv)
+		sink_initview(rv, buf, nbytes);
+	return rv;
+}
+
+
+/* slow path of sink_write and sink_putc */
+int sink_overflow(SINK *snp, const char *buf, int nbytes)
+{
+	return snp->snk_ops->so_overflow(snp, buf, nbytes);
+}
+
+
+int sink_printf(SINK *snp, char *fmt, ...)
+{
+	va_list ap;
+	int rv, nleft;
+	char *tbuf;
+
+	nleft = snp->snk_end - snp->snk_bp;
+	if (nleft) {
+		va_start(ap, fmt);
+		rv = vsnprintf(snp->snk_bp, nleft, fmt, ap);
+		va_end(ap);
+		if (rv < nleft) {
+			if (rv > 0)
+				snp->snk_bp += rv;
+			return rv;
+		}
+	}
+
+	/* string: keep what fit, including the NUL vsnprintf put at the end */
+	if (snp->snk_ops == &str_ops) {
+		snp->snk_bp = snp->snk_end;
+		return nleft;
+	}
+
+	/* drain the buffer and try again */
+	snp->snk_ops->so_flush(snp);
+	if (snp->snk_err)
+		return -1;
+	nleft = snp->snk_end - snp->snk_bp;
+	va_start(ap, fmt);
+	rv = vsnprintf(snp->snk_bp, nleft, fmt, ap);
+	va_end(ap);
+	if (rv < 0)
+		return rv;
+	if (rv < nleft) {
+		snp->snk_bp += rv;
+		return rv;
+	}
+
+	/* too big for the buffer */
+	tbuf = malloc(rv + 1);
+	if (!tbuf)
+		return -1;
+	va_start(ap, fmt);
+	rv = vsnprintf(tbuf, rv + 1, fmt, ap);
+	va_end(ap);
+	rv = sink_overflow(snp, tbuf, rv);
+	free(tbuf);
+	return rv;
+}
+
+
+/* returns number of bytes written, -1 if a write failed */
+int sink_fini(SINK *snp)
+{
+	int rv = snp->snk_ops->so_fini(snp);
 
 	memset(snp, 0, sizeof(SINK));
 	free(snp);
 	return rv;
 }
+
+
+/* returns number of bytes written to a sink from sink_initview */
+int sink_finiview(SINK *snp)
+{
+	return snp->snk_ops->so_fini(snp);
+}
@@ -16,28 +16,84 @@
  */
 
 /*
- * Routines for using a string or a file as an output sink.
+ * Routines for using a string, a file, growable memory, nothing (output
+ * only counted) or a hash as an output sink.
  */
 
 #ifndef _SINK_H
 #define _SINK_H 1
 
+#include <inttypes.h>
+#include <string.h>
+
+#define SINK_BUFSZ	4096	/* private buffer of buffered sinks */
+
+typedef struct sink SINK;
+
+/*
+ * Backend. Bytes are put in the buffer snk_buf..snk_end until it is
+ * full; so_overflow is then given the buffered bytes along with those
+ * that didn't fit, and returns how many of the latter it took, or -1
+ * if a write failed. Once one has failed, so does every later write.
+ */
 typedef struct {
-	FILE	*snk_fp;	/* file */
-	int	snk_nwrite;	/* file */
-	char	*snk_buf;	/* string */
-	char	*snk_bp;	/* string */
-	int	snk_nleft;	/* string */
-} SINK;
+	int	(*so_overflow)(SINK *snp, const char *buf, int nbytes);
+	void	(*so_flush)(SINK *snp);		/* drain buffer */
+	int	(*so_fini)(SINK *snp);		/* bytes written, -1 if error */
+} sink_ops_t;
 
-static inline FILE *sink_getf(SINK *snp) { return snp->snk_fp; }
+struct sink {
+	char		*snk_bp;	/* next free byte of buffer */
+	char		*snk_end;	/* end of buffer */
+	char		*snk_buf;
+	const sink_ops_t *snk_ops;
+	int		snk_nwrite;	/* bytes drained from buffer */
+	int		snk_err;	/* a drain failed */
+	FILE		*snk_fp;	/* file */
+	char		**snk_memp;	/* growable memory */
+	size_t		*snk_lenp;
+	uint64_t	snk_hash;	/* hashing */
+};
 
 extern SINK *sink_initf(FILE *fp);
 extern SINK *sink_initstr(char *buf, int nbytes);
+extern void sink_initview(SINK *snp, char *buf, int nbytes);
+extern SINK *sink_initmem(char **bufp, size_t *lenp);
+extern SINK *sink_initnull(void);
+extern SINK *sink_inithash(void);
 extern int sink_printf(SINK *snp, char *fmt, ...);
 #pragma printflike sink_printf
-extern int sink_write(SINK *snp, char *buf, int nbytes);
-extern int sink_putc(int c, SINK *snp);
+extern int sink_overflow(SINK *snp, const char *buf, int nbytes);
+extern FILE *sink_getf(SINK *snp);
+extern uint64_t sink_hashval(SINK *snp);
 extern int sink_fini(SINK *snp);
+extern int sink_finiview(SINK *snp);
+
+static inline int sink_write(SINK *snp, const char *buf, int nbytes)
+{
+	if (nbytes <= snp->snk_end - snp->snk_bp) {
+		memcpy(snp->snk_bp, buf, nbytes);
+		snp->snk_bp += nbytes;
+		return nbytes;
+	}
+	return sink_overflow(snp, buf, nbytes);
+}
+
+static inline int sink_putc(int c, SINK *snp)
+{
+	char ch = c;
+
+	if (snp->snk_bp < snp->snk_end) {
+		*snp->snk_bp++ = ch;
+		return 1;
+	}
+	return sink_overflow(snp, &ch, 1);
+}
+
+/* constant strings: strlen is done by the compiler */
+static inline int sink_puts(const char *str, SINK *snp)
+{
+	return sink_write(snp, str, strlen(str));
+}
 
 #endif /* _SINK_H */
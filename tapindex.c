@@ -0,0 +1,412 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Block-offset index of a tape image, kept in a sidecar file.
+ *
+ * The sidecar "path.tap.idx" is a text file:
+ *	tsbtap-index 1
+ *	image <size> <mtime.nsec> <hash>
+ *	access <ts_access>
+ * followed, in tape order, by one line per tapemark and per file:
+ *	M <offset>
+ *	F <offset> <nblocks> <tapemark offset> <directory entry | ->
+ * The index is rebuilt whenever the image's size, mtime or hash differ.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "simtap.h"
+#include "sink.h"
+#include "tapindex.h"
+#include "tsbtap.h"
+
+#define IDX_MAGIC	"tsbtap-index 1"
+#define HASH_SPAN	(64 * 1024)	/* bytes hashed at each end of image */
+
+typedef struct {
+	long long	id_size;
+	long long	id_sec;
+	long		id_nsec;
+	uint64_t	id_hash;
+} idx_ident_t;
+
+
+/* FNV-1a hash of up to nbytes at off in file */
+static uint64_t hash_span(int fd, off_t off, size_t nbytes, uint64_t h)
+{
+	unsigned char buf[8192];
+	ssize_t i, nread;
+
+	while (nbytes > 0) {
+		nread = pread(fd, buf, MIN(nbytes, sizeof buf), off);
+		if (nread <= 0)
+			break;
+		for (i = 0; i < nread; i++) {
+			h ^= buf[i];
+			h *= 0x100000001b3ULL;
+		}
+		off += nread;
+		nbytes -= nread;
+	}
+	return h;
+}
+
+
+/* returns -1 if image is not a regular file */
+static int idx_ident(TAPE *tap, idx_ident_t *id)
+{
+	struct stat st;
+	int fd = fileno(tap->tp_fp);
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	id->id_size = st.st_size;
+	id->id_sec = st.st_mtim.tv_sec;
+	id->id_nsec = st.st_mtim.tv_nsec;
+
+	/* hash both ends: labels at front, most recent dumps at end */
+	h = hash_span(fd, 0, HASH_SPAN, h);
+	if (st.st_size > HASH_SPAN)
+		h = hash_span(fd, MAX(st.st_size - HASH_SPAN, HASH_SPAN),
+			      HASH_SPAN, h);
+	id->id_hash = h;
+	return 0;
+}
+
+
+static tap_index_t *idx_alloc(void)
+{
+	tap_index_t *idx;
+
+	idx = malloc(sizeof(tap_index_t));
+	if (idx)
+		memset(idx, 0, sizeof(tap_index_t));
+	return idx;
+}
+
+
+/* returns new entry, NULL if out of memory */
+static idx_entry_t *idx_addent(tap_index_t *idx, off_t off)
+{
+	idx_entry_t *ent;
+	int n = idx->ix_nent;
+
+	/* grow table at powers of 2 */
+	if ((n & (n - 1)) == 0) {
+		ent = realloc(idx->ix_ent, MAX(2 * n, 64) * sizeof(idx_entry_t));
+		if (!ent)
+			return NULL;
+		idx->ix_ent = ent;
+	}
+
+	ent = idx->ix_ent + idx->ix_nent++;
+	memset(ent, 0, sizeof(idx_entry_t));
+	ent->ie_off = off;
+	ent->ie_mark = -1;
+	return ent;
+}
+
+
+/* returns -1 if out of memory */
+static int idx_addmark(tap_index_t *idx, off_t off)
+{
+	off_t *mark;
+	int n = idx->ix_nmark;
+
+	if ((n & (n - 1)) == 0) {
+		mark = realloc(idx->ix_mark, MAX(2 * n, 64) * sizeof(off_t));
+		if (!mark)
+			return -1;
+		idx->ix_mark = mark;
+	}
+
+	idx->ix_mark[idx->ix_nmark++] = off;
+	return 0;
+}
+
+
+void idx_close(tap_index_t *idx)
+{
+	if (idx->ix_ent)
+		free(idx->ix_ent);
+	if (idx->ix_mark)
+		free(idx->ix_mark);
+	memset(idx, 0, sizeof(tap_index_t));
+	free(idx);
+}
+
+
+/* scan the tape from the start the same way -x does */
+/* returns NULL if error */
+static tap_index_t *idx_build(tsb_ctx_t *tsb, TAPE *tap)
+{
+	tap_index_t *idx;
+	idx_entry_t *ent;
+	unsigned char *tbuf;
+	ssize_t nread;
+	off_t off;
+	int cur = -1;			/* entry being scanned */
+	int in_label = 0;
+
+	if (!(idx = idx_alloc()))
+		return NULL;
+
+	while (1) {
+		off = tap_tell(tap);
+
+		/* only first block of each file needs to be read */
+		if (cur >= 0 || in_label)
+			nread = tap_skipblock(tap, 1);
+		else
+			nread = tap_readblock(tap, (char **) &tbuf);
+		if (nread < 0)
+			break;
+
+		if (nread == 0) {
+			if (idx_addmark(idx, off) < 0)
+				goto nomem;
+			if (cur >= 0)
+				idx->ix_ent[cur].ie_mark = off;
+			cur = -1;
+			in_label = 0;
+			continue;
+		}
+
+		/* rest of file, or hibernate data after label */
+		if (cur >= 0) {
+			idx->ix_ent[cur].ie_nblocks++;
+			continue;
+		}
+		if (in_label)
+			continue;
+
+		if (is_tsb_label(tsb, tbuf, nread)) {
+			in_label = 1;
+			continue;
+		}
+
+		/* first block of file */
+		if (!(ent = idx_addent(idx, off)))
+			goto nomem;
+		ent->ie_nblocks = 1;
+		if (nread >= 24 + (tsb->ts_access > 0 ? 0 : 2)) {
+			memcpy(ent->ie_dbuf,
+			       tbuf + (tsb->ts_access > 0 ? 0 : 2), 24);
+			ent->ie_flags |= IE_DIRENT;
+		}
+		cur = ent - idx->ix_ent;
+	}
+
+	if (nread == -2) {
+		idx_close(idx);
+		return NULL;
+	}
+
+	idx->ix_access = tsb->ts_access;
+	dprint(("idx_build: %d files, %d marks\n", idx->ix_nent,
+		idx->ix_nmark));
+	return idx;
+
+nomem:
+	fprintf(stderr, "%s: out of memory for index\n", tap->tp_path);
+	idx_close(idx);
+	return NULL;
+}
+
+
+/* returns NULL if missing, stale, or unreadable */
+static tap_index_t *idx_load(char *path, idx_ident_t *id)
+{
+	FILE *fp;
+	tap_index_t *idx = NULL;
+	idx_ident_t fid;
+	idx_entry_t *ent;
+	char line[128], hex[64];
+	long long off, mark;
+	unsigned nblocks;
+	int i, c;
+
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+
+	/* header */
+	if (!fgets(line, sizeof line, fp) ||
+	    strncmp(line, IDX_MAGIC "\n", sizeof IDX_MAGIC) != 0)
+		goto bad;
+	if (!fgets(line, sizeof line, fp) ||
+	    sscanf(line, "image %lld %lld.%ld %" SCNx64, &fid.id_size,
+		   &fid.id_sec, &fid.id_nsec, &fid.id_hash) != 4)
+		goto bad;
+	if (fid.id_size != id->id_size || fid.id_sec != id->id_sec ||
+	    fid.id_nsec != id->id_nsec || fid.id_hash != id->id_hash) {
+		dprint(("idx_load: %s is stale\n", path));
+		goto bad;
+	}
+
+	if (!(idx = idx_alloc()))
+		goto bad;
+	if (!fgets(line, sizeof line, fp) ||
+	    sscanf(line, "access %d", &idx->ix_access) != 1)
+		goto bad;
+
+	/* marks and files */
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "M %lld", &off) == 1) {
+			if (idx_addmark(idx, off) < 0)
+				goto bad;
+			continue;
+		}
+
+		if (sscanf(line, "F %lld %u %lld %63s", &off, &nblocks, &mark,
+			   hex) != 4)
+			goto bad;
+		if (!(ent = idx_addent(idx, off)))
+			goto bad;
+		ent->ie_nblocks = nblocks;
+		ent->ie_mark = mark;
+		if (hex[0] == '-')
+			continue;
+		if (strlen(hex) != 48)
+			goto bad;
+		for (i = 0; i < 24; i++) {
+			if (sscanf(hex + 2*i, "%2x", &c) != 1)
+				goto bad;
+			ent->ie_dbuf[i] = c;
+		}
+		ent->ie_flags |= IE_DIRENT;
+	}
+
+	fclose(fp);
+	return idx;
+
+bad:
+	dprint(("idx_load: ignoring %s\n", path));
+	if (idx)
+		idx_close(idx);
+	fclose(fp);
+	return NULL;
+}
+
+
+/* write to temp file, then rename; returns -1 if error */
+static int idx_save(char *path, idx_ident_t *id, tap_index_t *idx)
+{
+	FILE *fp;
+	char *tmp;
+	idx_entry_t *ent;
+	int i, m = 0;
+
+	if (!(tmp = malloc(strlen(path) + 5)))
+		return -1;
+	sprintf(tmp, "%s.new", path);
+
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "%s\n", IDX_MAGIC);
+	fprintf(fp, "image %lld %lld.%09ld %016" PRIx64 "\n", id->id_size,
+		id->id_sec, id->id_nsec, id->id_hash);
+	fprintf(fp, "access %d\n", idx->ix_access);
+
+	/* interleave marks and files in tape order */
+	for (ent = idx->ix_ent; ent < idx->ix_ent + idx->ix_nent; ent++) {
+		for ( ; m < idx->ix_nmark && idx->ix_mark[m] < ent->ie_off; m++)
+			fprintf(fp, "M %lld\n", (long long) idx->ix_mark[m]);
+
+		fprintf(fp, "F %lld %u %lld ", (long long) ent->ie_off,
+			ent->ie_nblocks, (long long) ent->ie_mark);
+		if (ent->ie_flags & IE_DIRENT) {
+			for (i = 0; i < 24; i++)
+				fprintf(fp, "%02x", ent->ie_dbuf[i]);
+		} else
+			putc('-', fp);
+		putc('\n', fp);
+	}
+	for ( ; m < idx->ix_nmark; m++)
+		fprintf(fp, "M %lld\n", (long long) idx->ix_mark[m]);
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+	return 0;
+}
+
+
+/* load index for tape, building and saving it if needed */
+/* leaves tape positioned at start. returns NULL if no index available */
+tap_index_t *idx_open(tsb_ctx_t *tsb, TAPE *tap)
+{
+	tap_index_t *idx;
+	idx_ident_t id;
+	char *path;
+
+	if (idx_ident(tap, &id) < 0) {
+		fprintf(stderr, "%s: not a regular file, not indexed\n",
+			tap->tp_path);
+		return NULL;
+	}
+
+	if (!(path = malloc(strlen(tap->tp_path) + sizeof IDX_SUFFIX))) {
+		fprintf(stderr, "%s: out of memory for index\n", tap->tp_path);
+		return NULL;
+	}
+	sprintf(path, "%s%s", tap->tp_path, IDX_SUFFIX);
+
+	/* use saved index if it was built with same tape format */
+	idx = idx_load(path, &id);
+	if (idx && tsb->ts_access >= 0 &&
+	    (tsb->ts_access > 0) != (idx->ix_access > 0)) {
+		dprint(("idx_open: %s built with access=%d\n", path,
+			idx->ix_access));
+		idx_close(idx);
+		idx = NULL;
+	}
+
+	if (idx) {
+		if (tsb->ts_access < 0)
+			tsb->ts_access = idx->ix_access;
+	} else {
+		idx = idx_build(tsb, tap);
+		if (idx)
+			(void) idx_save(path, &id, idx);
+		if (tap_seek(tap, 0) < 0) {
+			fprintf(stderr, "%s: can't rewind\n", tap->tp_path);
+			if (idx)
+				idx_close(idx);
+			idx = NULL;
+		}
+	}
+
+	free(path);
+	return idx;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Block-offset index of a tape image, kept in a sidecar file.
+ */
+
+#ifndef _TAPINDEX_H
+#define _TAPINDEX_H 1
+
+#define IDX_SUFFIX	".idx"
+
+struct tsb_ctx;
+
+/* ie_flags bits */
+#define IE_DIRENT	0x1		/* ie_dbuf is valid */
+
+typedef struct {
+	off_t		ie_off;		/* first block of file */
+	off_t		ie_mark;	/* terminating tapemark, -1 if none */
+	uint32_t	ie_nblocks;
+	int		ie_flags;
+	unsigned char	ie_dbuf[24];	/* directory entry */
+} idx_entry_t;
+
+typedef struct {
+	int		ix_access;	/* ts_access when built */
+	int		ix_nent;
+	idx_entry_t	*ix_ent;
+	int		ix_nmark;
+	off_t		*ix_mark;	/* all tapemarks, in tape order */
+} tap_index_t;
+
+extern tap_index_t *idx_open(struct tsb_ctx *tsb, TAPE *tap);
+extern void idx_close(tap_index_t *idx);
+
+#endif /* _TAPINDEX_H */
@@ -31,9 +31,11 @@
 
 /* reading if buf != NULL, else writing */
 /* returns -1 on error */
-int tfile_ctx_init(tfile_ctx_t *ctx, TAPE *tap, char *buf, int nbytes, int hdr)
+int tfile_ctx_init(tfile_ctx_t *ctx, tsb_ctx_t *tsb, TAPE *tap, char *buf,
+		   int nbytes, int hdr)
 {
 	memset(ctx, 0, sizeof(tfile_ctx_t));
+	ctx->tf_tsb = tsb;
 	ctx->tf_tap = tap;
 	ctx->tf_hdr = hdr;
 	ctx->tf_bufsize = nbytes;
@@ -91,7 +93,6 @@ void tfile_ctx_fini(tfile_ctx_t *ctx)
 int tfile_skipf(tfile_ctx_t *ctx)
 {
 	ssize_t nbytes;
-	char *unused;
 
 	dprint(("tfile_skipf\n"));
 
@@ -101,8 +102,9 @@ int tfile_skipf(tfile_ctx_t *ctx)
 		return -1;
 	}
 
+	/* only block headers and trailers need to be read */
 	if (!ctx->tf_ateof) {
-		while (nbytes = tap_readblock(ctx->tf_tap, &unused)) {
+		while (nbytes = tap_skipblock(ctx->tf_tap, 1)) {
 			if (nbytes == -2)
 				return -1;
 			if (nbytes < 0)
@@ -140,10 +142,28 @@ int tfile_skipbytes(tfile_ctx_t *ctx, int nbytes)
 
 		rv += ctx->tf_nleft;
 		nbytes -= ctx->tf_nleft;
+		ctx->tf_nleft = 0;
 
-		/* read next tape block */
-		nread = tap_readblock(ctx->tf_tap, &ctx->tf_buf);
-		dprint(("tfile_skipbytes: readblock returned %ld\n", nread));
+		/* skip whole tape block without reading its data */
+		nread = tap_peekblock(ctx->tf_tap);
+		if (nread > 0 && nread - ctx->tf_hdr <= nbytes) {
+			nread = tap_skipblock(ctx->tf_tap, 1);
+			dprint(("tfile_skipbytes: skipblock returned %ld\n",
+				nread));
+			if (nread > ctx->tf_hdr) {
+				rv += nread - ctx->tf_hdr;
+				nbytes -= nread - ctx->tf_hdr;
+			}
+			if (nread > 0) {
+				ctx->tf_buf = ctx->tf_bp = NULL;
+				continue;
+			}
+		} else {
+			/* read next tape block */
+			nread = tap_readblock(ctx->tf_tap, &ctx->tf_buf);
+			dprint(("tfile_skipbytes: readblock returned %ld\n",
+				nread));
+		}
 		if (nread <= 0) {
 			ctx->tf_bp = NULL;
 			ctx->tf_nleft = 0;
@@ -170,6 +190,32 @@ int tfile_skipbytes(tfile_ctx_t *ctx, int nbytes)
 }
 
 
+/* read next block of file; returns its size, -2 if error, -1 if end of file */
+static int tfile_nextblock(tfile_ctx_t *ctx, char *who)
+{
+	int nread;
+
+	do {
+		nread = tap_readblock(ctx->tf_tap, &ctx->tf_buf);
+		dprint(("%s: readblock returned %d\n", who, nread));
+		if (nread <= 0) {
+			ctx->tf_bp = NULL;
+			ctx->tf_nleft = 0;
+			ctx->tf_ateof = 1;
+			return nread == -2 ? -2 : -1;
+		}
+
+		/* skip over pre-Access header bytes */
+		ctx->tf_buf += ctx->tf_hdr;
+		nread -= ctx->tf_hdr;
+	} while (nread <= 0);
+
+	ctx->tf_bp = ctx->tf_buf;
+	ctx->tf_nleft = nread;
+	return nread;
+}
+
+
 /* returns number of bytes copied, -2 if error, -1 if end of file */
 int tfile_getbytes(tfile_ctx_t *ctx, char *buf, int nbytes)
 {
@@ -186,30 +232,13 @@ int tfile_getbytes(tfile_ctx_t *ctx, char *buf, int nbytes)
 
 	while (nbytes > 0) {
 		if (ctx->tf_nleft == 0) {
-			/* read next tape block */
-			nread = tap_readblock(ctx->tf_tap, &ctx->tf_buf);
-			dprint(("tfile_getbytes: readblock returned %d\n",
-				nread));
-			if (nread <= 0) {
-				ctx->tf_bp = NULL;
-				ctx->tf_nleft = 0;
-				ctx->tf_ateof = 1;
-				if (nread == -2)
-					return -2;
+			nread = tfile_nextblock(ctx, "tfile_getbytes");
+			if (nread == -2)
+				return -2;
+			if (nread < 0) {
 				dprint(("tfile_getbytes: short copy %d\n", rv));
 				return rv ? rv : -1;
 			}
-
-			/* skip over pre-Access header bytes */
-			ctx->tf_buf += ctx->tf_hdr;
-			nread -= ctx->tf_hdr;
-			if (nread <= 0) {
-				ctx->tf_nleft = 0;
-				continue;
-			}
-
-			ctx->tf_bp = ctx->tf_buf;
-			ctx->tf_nleft = nread;
 		}
 
 		nread = MIN(nbytes, ctx->tf_nleft);
@@ -227,6 +256,37 @@ int tfile_getbytes(tfile_ctx_t *ctx, char *buf, int nbytes)
 }
 
 
+/*
+ * Like tfile_getbytes, but instead of copying, points *bufp at the bytes
+ * in the current tape block. Only if they straddle a block boundary are
+ * they copied, into scratch (at least nbytes). The bytes must not be
+ * modified, and are valid until the next read from ctx -- or as long as
+ * the tape is open, if it is mapped and the bytes were not copied.
+ */
+/* returns number of bytes, -2 if error, -1 if end of file */
+int tfile_span(tfile_ctx_t *ctx, char **bufp, int nbytes, char *scratch)
+{
+	int nread;
+
+	if (nbytes > 0 && ctx->tf_nleft == 0 && !ctx->tf_ateof &&
+	    !tap_is_write(ctx->tf_tap)) {
+		nread = tfile_nextblock(ctx, "tfile_span");
+		if (nread < 0)
+			return nread;
+	}
+
+	if (nbytes <= ctx->tf_nleft && !ctx->tf_ateof) {
+		*bufp = ctx->tf_bp;
+		ctx->tf_bp += nbytes;
+		ctx->tf_nleft -= nbytes;
+		return nbytes;
+	}
+
+	*bufp = scratch;
+	return tfile_getbytes(ctx, scratch, nbytes);
+}
+
+
 /* returns 0 on success, -1 if error */
 int tfile_flushblock(tfile_ctx_t *ctx, int minsz)
 {
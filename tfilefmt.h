@@ -26,7 +26,10 @@
 
 #define TBLOCKSIZE 2048		/* observed tape block size */
 
+struct tsb_ctx;
+
 typedef struct {
+	struct tsb_ctx *tf_tsb;	/* tape being decoded */
 	TAPE	*tf_tap;
 	char	*tf_buf;
 	char	*tf_bp;
@@ -36,10 +39,12 @@ typedef struct {
 	int	tf_ateof;
 } tfile_ctx_t;
 
-extern int tfile_ctx_init(tfile_ctx_t *ctx, TAPE *tap, char *buf, int nbytes,
-			  int hdr);
+extern int tfile_ctx_init(tfile_ctx_t *ctx, struct tsb_ctx *tsb, TAPE *tap,
+			  char *buf, int nbytes, int hdr);
 extern void tfile_ctx_fini(tfile_ctx_t *ctx);
 extern int tfile_getbytes(tfile_ctx_t *ctx, char *buf, int nbytes);
+extern int tfile_span(tfile_ctx_t *ctx, char **bufp, int nbytes,
+		      char *scratch);
 extern int tfile_skipbytes(tfile_ctx_t *ctx, int nbytes);
 extern int tfile_skipf(tfile_ctx_t *ctx);
 extern int tfile_putbytes(tfile_ctx_t *ctx, char *buf, int nbytes);
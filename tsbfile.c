@@ -53,29 +53,31 @@ void rec_init(rec_ctx_t *ctx, tfile_ctx_t *tfile, int recsz)
 
 void rec_skip(rec_ctx_t *ctx)
 {
-	unsigned char buf[512];
 	int nskip, nread;
 
 	nskip = ctx->rec_nleft + ctx->rec_pad;
-	nread = tfile_getbytes(ctx->rec_ctx, buf, nskip);
+	nread = tfile_skipbytes(ctx->rec_ctx, nskip);
 	if (nread != nskip)
 		dprint(("rec_skip: EOF at 0x%lx\n",
-			ftell(ctx->rec_ctx->tf_tap->tp_fp)));
+			tap_tell(ctx->rec_ctx->tf_tap)));
 	ctx->rec_nleft = 0;
 }
 
 
-/* returns number of bytes copied, -1 if EOF. nbytes must be even */
-int rec_getbytes(rec_ctx_t *ctx, unsigned char *buf, int nbytes)
+/* bytes in *bufp, copied to scratch only if they cross a block boundary */
+/* returns number of bytes, -1 if EOF. nbytes must be even */
+int rec_span(rec_ctx_t *ctx, unsigned char **bufp, int nbytes,
+	     unsigned char *scratch)
 {
 	int nread;
 
 	assert((nbytes & 1) == 0);
 	nbytes = MIN(ctx->rec_nleft, nbytes);
-	nread = tfile_getbytes(ctx->rec_ctx, buf, nbytes);
+	nread = tfile_span(ctx->rec_ctx, (char **) bufp, nbytes,
+			   (char *) scratch);
 	if (nread != nbytes)
-		dprint(("rec_getbytes: EOF at 0x%lx\n",
-			ftell(ctx->rec_ctx->tf_tap->tp_fp)));
+		dprint(("rec_span: EOF at 0x%lx\n",
+			tap_tell(ctx->rec_ctx->tf_tap)));
 	if (nread < 0)
 		return nread;
 	ctx->rec_nleft -= nread;
@@ -87,20 +89,20 @@ char *extract_ascii_file(tfile_ctx_t *tfile, char *fn, char *oname,
 			 unsigned char *dbuf)
 {
 	SINK *snp;
-	unsigned char buf[512];
+	unsigned char sbuf[512], *buf;
 	char *err = NULL;
 	int rv = 0;
 
 	if (BE16(dbuf+16) == 0xffff) {
 		unsigned device = BE16(dbuf+18);
 
-		printf("%s: not extracting device %c%c%d\n", fn,
-		       'A' + (device >> 10), 'A' + ((device >> 5) & 0x1f),
-		       device & 0x1f);
+		fprintf(out_msgf(tfile->tf_tsb), "%s: not extracting device %c%c%d\n",
+			fn, 'A' + (device >> 10), 'A' + ((device >> 5) & 0x1f),
+			device & 0x1f);
 		return "";
 	}
 
-	snp = out_open(fn, "txt", oname);
+	snp = out_open(tfile->tf_tsb, fn, "txt", oname);
 	if (!snp)
 		return "";
 
@@ -111,7 +113,7 @@ char *extract_ascii_file(tfile_ctx_t *tfile, char *fn, char *oname,
 
 		rec_init(&ctx, tfile, 256);
 
-		while ((rv = rec_getbytes(&ctx, buf, 2)) == 2) {
+		while ((rv = rec_span(&ctx, &buf, 2, sbuf)) == 2) {
 			int stlen, nbytes;
 
 			stlen = BE16(buf);
@@ -126,7 +128,7 @@ char *extract_ascii_file(tfile_ctx_t *tfile, char *fn, char *oname,
 				break;
 
 			nbytes = (stlen+1) & ~1;
-			if (rec_getbytes(&ctx, buf, nbytes) != nbytes) {
+			if (rec_span(&ctx, &buf, nbytes, sbuf) != nbytes) {
 				err = "string extends past end of ASCII file";
 				break;
 			}
@@ -146,7 +148,8 @@ char *extract_ascii_file(tfile_ctx_t *tfile, char *fn, char *oname,
 		rec_skip(&ctx);
 	}
 
-	out_close(snp);
+	if (out_close(tfile->tf_tsb, snp) < 0 && !err)
+		err = "error writing output";
 	return err;
 }
 
@@ -155,12 +158,12 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 			 unsigned char *dbuf)
 {
 	SINK *snp;
-	unsigned char buf[512];
+	unsigned char sbuf[512], *buf, num[4];
 	char *err = NULL;
 	int rv = 0;
 	int recsz = BE16(dbuf+8);
 
-	snp = out_open(fn, "csv", oname);
+	snp = out_open(tfile->tf_tsb, fn, "csv", oname);
 	if (!snp)
 		return "";
 
@@ -172,7 +175,7 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 
 		rec_init(&ctx, tfile, recsz);
 
-		for ( ; (rv = rec_getbytes(&ctx, buf, 2)) == 2; sep = ",") {
+		for ( ; (rv = rec_span(&ctx, &buf, 2, sbuf)) == 2; sep = ",") {
 			int code, bits;
 
 			code = BE16(buf);
@@ -180,7 +183,8 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 
 			/* EOF marker or end-of-record */
 			if (code == 0xffff) {
-				sink_printf(snp, "%s END", sep);
+				sink_puts(sep, snp);
+				sink_puts(" END", snp);
 				break;
 			}
 			if (code == 0xfffe)
@@ -192,25 +196,26 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 
 				/* consume even number of bytes */
 				bits = (stlen+1) & ~1;
-				if (rec_getbytes(&ctx, buf, bits) != bits) {
+				if (rec_span(&ctx, &buf, bits, sbuf) != bits) {
 					err = "string extends past end of "
 					      "record";
 					break;
 				}
 
-				sink_printf(snp, "%s\"", sep);
+				sink_puts(sep, snp);
+				sink_putc('"', snp);
 				for (i = 0; i < stlen; i++) {
 					switch (c = buf[i]) {
 					    case '"':
-						sink_printf(snp, "\"\"");
+						sink_puts("\"\"", snp);
 						break;
 
 					    case '\0':
-						sink_printf(snp, "\\000");
+						sink_puts("\\000", snp);
 						break;
 
 					    case '\n':
-						sink_printf(snp, "\\n");
+						sink_puts("\\n", snp);
 						break;
 
 					    default:
@@ -225,16 +230,21 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 			/* number */
 			bits = code & 0xc000;
 			if (bits != 0x8000 && bits != 0x4000 && code != 0) {
-				printf("unrecognized item 0x%04x\n", code);
+				fprintf(out_msgf(tfile->tf_tsb),
+					"unrecognized item 0x%04x\n", code);
 				err = "";
 				break;
 			}
-			if (rec_getbytes(&ctx, buf+2, 2) != 2) {
+			num[0] = buf[0];
+			num[1] = buf[1];
+			if (rec_span(&ctx, &buf, 2, sbuf) != 2) {
 				err = "number extends past end of record";
 				break;
 			}
-			sink_printf(snp, "%s", sep);
-			print_number(snp, buf);
+			num[2] = buf[0];
+			num[3] = buf[1];
+			sink_puts(sep, snp);
+			print_number(snp, num);
 		}
 
 		if (err)
@@ -245,6 +255,7 @@ char *extract_basic_file(tfile_ctx_t *tfile, char *fn, char *oname,
 			sink_putc('\n', snp);
 	}
 
-	out_close(snp);
+	if (out_close(tfile->tf_tsb, snp) < 0 && !err)
+		err = "error writing output";
 	return err;
 }
@@ -26,10 +26,12 @@
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #include "simtap.h"
 #include "sink.h"
 #include "outfile.h"
 #include "tfilefmt.h"
+#include "hpfloat.h"
 #include "tsbprog.h"
 #include "tsbtap.h"
 
@@ -43,41 +45,144 @@
  * This allows CSAVEd programs to be un-CSAVEd in-place. It also allows
  * a conversion between 2000 TSB versions to re-interpret a statement if
  * an unsupported token is encountered mid-statement.
+ *
+ * Programs that only need to be read once, in order, can instead be
+ * streamed: after prog_stream(), each stmt_init() reads the next
+ * statement from tape, and only that statement is kept in the buffer.
  */
 
-int prog_init(prog_ctx_t *prog, tfile_ctx_t *tfile)
+/*
+ * Per-tape pool of program buffers, so that extracting or converting
+ * many programs reuses a few buffers instead of allocating one for each.
+ * Worker threads decoding files of the same tape share the pool.
+ */
+#define PP_MAXBUF	8
+
+struct prog_pool {
+	pthread_mutex_t	pp_lock;
+	int		pp_nbuf;
+	unsigned char	*pp_buf[PP_MAXBUF];
+	int		pp_bufsz[PP_MAXBUF];
+};
+
+
+/* returns NULL if out of memory */
+prog_pool_t *prog_pool_init(void)
 {
-	unsigned char *buf;
-	int rv, nread;
+	prog_pool_t *pp;
+
+	pp = malloc(sizeof(prog_pool_t));
+	if (pp) {
+		memset(pp, 0, sizeof(prog_pool_t));
+		pthread_mutex_init(&pp->pp_lock, NULL);
+	}
+	return pp;
+}
+
+
+void prog_pool_fini(prog_pool_t *pp)
+{
+	int i;
+
+	for (i = 0; i < pp->pp_nbuf; i++)
+		free(pp->pp_buf[i]);
+	pthread_mutex_destroy(&pp->pp_lock);
+	memset(pp, 0, sizeof(prog_pool_t));
+	free(pp);
+}
+
+
+/* buffer of at least *bufszp bytes; actual size returned in *bufszp */
+static unsigned char *pool_get(tsb_ctx_t *tsb, int *bufszp)
+{
+	prog_pool_t *pp = tsb->ts_pool;
+	unsigned char *buf = NULL;
+	int bufsz = 0;
+
+	if (pp) {
+		pthread_mutex_lock(&pp->pp_lock);
+		if (pp->pp_nbuf > 0) {
+			pp->pp_nbuf--;
+			buf = pp->pp_buf[pp->pp_nbuf];
+			bufsz = pp->pp_bufsz[pp->pp_nbuf];
+		}
+		pthread_mutex_unlock(&pp->pp_lock);
+	}
+
+	if (bufsz >= *bufszp) {
+		*bufszp = bufsz;
+		return buf;
+	}
+	free(buf);
+	return malloc(*bufszp);
+}
+
+
+static void pool_put(tsb_ctx_t *tsb, unsigned char *buf, int bufsz)
+{
+	prog_pool_t *pp = tsb->ts_pool;
+
+	if (pp) {
+		pthread_mutex_lock(&pp->pp_lock);
+		if (pp->pp_nbuf < PP_MAXBUF) {
+			pp->pp_buf[pp->pp_nbuf] = buf;
+			pp->pp_bufsz[pp->pp_nbuf] = bufsz;
+			pp->pp_nbuf++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&pp->pp_lock);
+	}
+	free(buf);
+}
+
+
+/* szhint is the size from the directory entry, in bytes (<= 0 if unknown) */
+int prog_init(prog_ctx_t *prog, tfile_ctx_t *tfile, int szhint)
+{
+	tsb_ctx_t *tsb = tfile->tf_tsb;
+	unsigned char *buf, *nbuf;
+	int rv, nread, readsz;
 	int bufsz = 8 * TBLOCKSIZE;	/* should hold largest TSB program */
-	int readsz = bufsz;
 
 	memset(prog, 0, sizeof(prog_ctx_t));
+	prog->pg_tsb = tsb;
+
+	/* room for the hinted size, plus a block so its end is seen */
+	if (szhint > 0 && szhint <= 0x10000)
+		bufsz = (szhint / TBLOCKSIZE + 2) * TBLOCKSIZE;
 
 	/* allocate initial buffer */
-	if (!(buf = malloc(bufsz))) {
-		printf("out of memory for BASIC program\n");
+	if (!(buf = pool_get(tsb, &bufsz))) {
+		fprintf(out_msgf(tsb), "out of memory for BASIC program\n");
 		return -2;
 	}
 
 	/* read in entire program */
-	for (nread = 0;
-	     (rv = tfile_getbytes(tfile, buf+nread, readsz)) == readsz;
-	     nread += rv) {
-		/* grow buffer, continue reading */
-		bufsz += TBLOCKSIZE;
-		if (!(buf = realloc(buf, bufsz))) {
-			printf("out of memory for BASIC program\n");
+	for (nread = 0; ; nread += rv) {
+		readsz = bufsz - nread;
+		rv = tfile_getbytes(tfile, (char *) buf+nread, readsz);
+		if (rv != readsz)
+			break;
+
+		/* hint was wrong: grow buffer, continue reading */
+		if (!(nbuf = realloc(buf, 2 * bufsz))) {
+			fprintf(out_msgf(tsb),
+				"out of memory for BASIC program\n");
+			free(buf);
 			return -2;
 		}
-		readsz = TBLOCKSIZE;
+		buf = nbuf;
+		bufsz *= 2;
 	}
-	if (rv == -2)
+	if (rv == -2) {
+		pool_put(tsb, buf, bufsz);
 		return rv;
+	}
 	if (rv >= 0)
 		nread += rv;
 
 	prog->pg_buf = prog->pg_bp = buf;
+	prog->pg_bufsz = bufsz;
 	prog->pg_sz = prog->pg_nread = nread;
 	dprint(("prog_init: bufsz=%d progsz=%d\n", bufsz, nread));
 
@@ -85,6 +190,94 @@ int prog_init(prog_ctx_t *prog, tfile_ctx_t *tfile)
 }
 
 
+/* nbytes is the size from the directory entry, in bytes */
+/* returns -2 if out of memory */
+int prog_stream(prog_ctx_t *prog, tfile_ctx_t *tfile, int nbytes)
+{
+	tsb_ctx_t *tsb = tfile->tf_tsb;
+	int bufsz = TBLOCKSIZE;
+
+	memset(prog, 0, sizeof(prog_ctx_t));
+	prog->pg_tsb = tsb;
+	prog->pg_tfile = tfile;
+	prog->pg_left = nbytes;
+	if (nbytes <= 0) {
+		fprintf(out_msgf(tsb), "invalid size in directory entry\n");
+		prog->pg_left = -1;
+	}
+
+	if (!(prog->pg_buf = prog->pg_bp = pool_get(tsb, &bufsz))) {
+		fprintf(out_msgf(tsb), "out of memory for BASIC program\n");
+		return -2;
+	}
+	prog->pg_bufsz = bufsz;
+	return 0;
+}
+
+
+/* streaming: append up to nbytes of program text to pg_buf */
+/* returns number of bytes, -2 if error */
+static int prog_read(prog_ctx_t *prog, int nbytes)
+{
+	unsigned char *nbuf;
+	int rv, bufsz;
+
+	if (prog->pg_left >= 0)
+		nbytes = MIN(nbytes, prog->pg_left);
+	if (nbytes <= 0)
+		return 0;
+
+	if (prog->pg_sz + nbytes > prog->pg_bufsz) {
+		bufsz = (prog->pg_sz + nbytes + TBLOCKSIZE - 1) &
+			~(TBLOCKSIZE - 1);
+		if (!(nbuf = realloc(prog->pg_buf, bufsz))) {
+			fprintf(out_msgf(prog->pg_tsb),
+				"out of memory for BASIC program\n");
+			return -2;
+		}
+		prog->pg_buf = nbuf;
+		prog->pg_bufsz = bufsz;
+	}
+
+	rv = tfile_getbytes(prog->pg_tfile, (char *) prog->pg_buf + prog->pg_sz,
+			    nbytes);
+	if (rv == -2)
+		return rv;
+	if (rv < 0)
+		rv = 0;
+	prog->pg_sz += rv;
+	prog->pg_nread += rv;
+
+	if (prog->pg_left >= 0) {
+		prog->pg_left -= rv;
+		if (rv < nbytes) {
+			fprintf(out_msgf(prog->pg_tsb),
+				"invalid size in directory entry\n");
+			prog->pg_left = 0;
+		}
+	}
+	return rv;
+}
+
+
+/* streaming: replace contents of pg_buf with the next statement */
+/* returns -2 if error */
+static int prog_readstmt(prog_ctx_t *prog)
+{
+	int rv;
+
+	prog->pg_bp = prog->pg_buf;
+	prog->pg_sz = 0;
+
+	/* line number, count of 16-bit words; then the rest */
+	if ((rv = prog_read(prog, 4)) < 4)
+		return rv == -2 ? rv : 0;
+	rv = prog_read(prog, 2 * BE16(prog->pg_buf+2) - 4);
+	prog->pg_bp = prog->pg_buf;
+	return rv == -2 ? rv : 0;
+}
+
+
 void prog_setsz(prog_ctx_t *prog, int nbytes)
 {
 	dprint(("prog_setsz: read %d, dir len %d\n", prog->pg_sz, nbytes));
@@ -92,7 +285,7 @@ void prog_setsz(prog_ctx_t *prog, int nbytes)
 	if (nbytes > 0 && nbytes <= prog->pg_sz)
 		prog->pg_sz = nbytes;
 	else
-		printf("invalid size in directory entry\n");
+		fprintf(out_msgf(prog->pg_tsb), "invalid size in directory entry\n");
 }
 
 
@@ -131,17 +324,20 @@ int prog_getbytesat(prog_ctx_t *prog, unsigned char **bufp, int nbytes, int off)
 void prog_fini(prog_ctx_t *prog)
 {
 	if (prog->pg_buf)
-		free(prog->pg_buf);
+		pool_put(prog->pg_tsb, prog->pg_buf, prog->pg_bufsz);
 	memset(prog, 0, sizeof(prog_ctx_t));
 }
 
 
-/* returns TSB line number, -1 if error */
+/* returns TSB line number, -1 if end of program, -2 if error */
 int stmt_init(stmt_ctx_t *ctx, prog_ctx_t *prog)
 {
 	unsigned char *buf;
 	int nbytes;
 
+	if (prog->pg_tfile && prog_readstmt(prog) == -2)
+		return -2;
+
 	/* get line number, count of 16-bit words */
 	nbytes = prog_getbytes(prog, &buf, 4);
 	if (nbytes < 4) {
@@ -175,50 +371,122 @@ void stmt_fini(stmt_ctx_t *ctx)
 }
 
 
-static char *access_stmts[] = {
-	"?00", "?01", "?02", "?03", "?04", "?05", "?06", "?07",
-	"?10", "?11", "?12", "?13", "?14", "?15", "?16", "?17",
-	"?20", "?21", "?22", "?23", "?24", "?25", "?26", "?27",
-	"?30", "?31", "SYSTEM", "CONVERT", "LOCK", "UNLOCK", "CREATE", "PURGE",
-	"ADVANCE", "UPDATE", "ASSIGN", "LINPUT", "IMAGE", "COM", "LET", "DIM",
-	"DEF", "REM", "GOTO", "IF", "FOR", "NEXT", "GOSUB", "RETURN",
-	"END", "STOP", "DATA", "INPUT", "READ", "PRINT", "RESTORE", "MAT",
-	"FILES", "CHAIN", "ENTER", " " /* (LET) */, "?74", "?75", "?76", "?77"
+/*
+ * Detokenizing: each BASIC line is put together in a buffer, from token
+ * spellings whose lengths are known in advance, and written out in one
+ * piece. A line too long for the buffer is written out in parts.
+ */
+#define LINE_BUFSZ	4096
+#define LINE_TOKSZ	1040	/* most one token can add: a string */
+
+typedef struct {
+	SINK	*ln_snp;
+	char	*ln_bp;			/* next free byte of ln_buf */
+	char	ln_buf[LINE_BUFSZ];
+} line_t;
+
+/* token spelling; tk_space: set off by spaces (a word, not punctuation) */
+typedef struct {
+	const char	*tk_name;
+	unsigned char	tk_len;
+	unsigned char	tk_space;
+} tok_name_t;
+
+#define TK(s)	{ s, sizeof(s) - 1, sizeof(s) > 2 }
+
+static const tok_name_t access_stmts[] = {
+	TK("?00"), TK("?01"), TK("?02"), TK("?03"), TK("?04"), TK("?05"),
+	TK("?06"), TK("?07"), TK("?10"), TK("?11"), TK("?12"), TK("?13"),
+	TK("?14"), TK("?15"), TK("?16"), TK("?17"), TK("?20"), TK("?21"),
+	TK("?22"), TK("?23"), TK("?24"), TK("?25"), TK("?26"), TK("?27"),
+	TK("?30"), TK("?31"), TK("SYSTEM"), TK("CONVERT"), TK("LOCK"),
+	TK("UNLOCK"), TK("CREATE"), TK("PURGE"), TK("ADVANCE"), TK("UPDATE"),
+	TK("ASSIGN"), TK("LINPUT"), TK("IMAGE"), TK("COM"), TK("LET"),
+	TK("DIM"), TK("DEF"), TK("REM"), TK("GOTO"), TK("IF"), TK("FOR"),
+	TK("NEXT"), TK("GOSUB"), TK("RETURN"), TK("END"), TK("STOP"),
+	TK("DATA"), TK("INPUT"), TK("READ"), TK("PRINT"), TK("RESTORE"),
+	TK("MAT"), TK("FILES"), TK("CHAIN"), TK("ENTER"), TK(" ") /* (LET) */,
+	TK("?74"), TK("?75"), TK("?76"), TK("?77")
 };
-static char *access_ops[] = {
-	"", "" /* " */, ",", ";", "#", "?05", "?06", "?07",
-	")", "]", "[", "(", "+", "-", ",", "=",
-	"+", "-", "*", "/", "^", ">", "<", "#",
-	"=", "?31", "AND", "OR", "MIN", "MAX", "<>", ">=",
-	"<=", "NOT", "**", "USING", "RR", "WR", "NR", "ERROR",
-	"?50", "?51", "?52", "?53", "?54", "?55", "?56", "?57",
-	"END", "?61", "?62", "INPUT", "READ", "PRINT", "?66", "?67",
-	"?70", "?71", "?72", "?73", "OF", "THEN", "TO", "STEP"
+static const tok_name_t access_ops[] = {
+	TK(""), TK("") /* " */, TK(","), TK(";"), TK("#"), TK("?05"),
+	TK("?06"), TK("?07"), TK(")"), TK("]"), TK("["), TK("("), TK("+"),
+	TK("-"), TK(","), TK("="), TK("+"), TK("-"), TK("*"), TK("/"), TK("^"),
+	TK(">"), TK("<"), TK("#"), TK("="), TK("?31"), TK("AND"), TK("OR"),
+	TK("MIN"), TK("MAX"), TK("<>"), TK(">="), TK("<="), TK("NOT"),
+	TK("**"), TK("USING"), TK("RR"), TK("WR"), TK("NR"), TK("ERROR"),
+	TK("?50"), TK("?51"), TK("?52"), TK("?53"), TK("?54"), TK("?55"),
+	TK("?56"), TK("?57"), TK("END"), TK("?61"), TK("?62"), TK("INPUT"),
+	TK("READ"), TK("PRINT"), TK("?66"), TK("?67"), TK("?70"), TK("?71"),
+	TK("?72"), TK("?73"), TK("OF"), TK("THEN"), TK("TO"), TK("STEP")
 };
-static char *tsb2000f_ops[] = {
-	"", "" /* " */, ",", ";", "#", "?05", "?06", "?07",
-	")", "]", "[", "(", "+", "-", ",", "=",
-	"+", "-", "*", "/", "^", ">", "<", "#",
-	"=", "?31", "AND", "OR", "MIN", "MAX", "<>", ">=",
-	"<=", "NOT", "ASSIGN", "USING", "IMAGE", "COM", "LET", "DIM",
-	"DEF", "REM", "GOTO", "IF", "FOR", "NEXT", "GOSUB", "RETURN",
-	"END", "STOP", "DATA", "INPUT", "READ", "PRINT", "RESTORE", "MAT",
-	"FILES", "CHAIN", "ENTER", " " /* (LET) */, "OF", "THEN", "TO", "STEP"
+static const tok_name_t tsb2000f_ops[] = {
+	TK(""), TK("") /* " */, TK(","), TK(";"), TK("#"), TK("?05"),
+	TK("?06"), TK("?07"), TK(")"), TK("]"), TK("["), TK("("), TK("+"),
+	TK("-"), TK(","), TK("="), TK("+"), TK("-"), TK("*"), TK("/"), TK("^"),
+	TK(">"), TK("<"), TK("#"), TK("="), TK("?31"), TK("AND"), TK("OR"),
+	TK("MIN"), TK("MAX"), TK("<>"), TK(">="), TK("<="), TK("NOT"),
+	TK("ASSIGN"), TK("USING"), TK("IMAGE"), TK("COM"), TK("LET"),
+	TK("DIM"), TK("DEF"), TK("REM"), TK("GOTO"), TK("IF"), TK("FOR"),
+	TK("NEXT"), TK("GOSUB"), TK("RETURN"), TK("END"), TK("STOP"),
+	TK("DATA"), TK("INPUT"), TK("READ"), TK("PRINT"), TK("RESTORE"),
+	TK("MAT"), TK("FILES"), TK("CHAIN"), TK("ENTER"), TK(" ") /* (LET) */,
+	TK("OF"), TK("THEN"), TK("TO"), TK("STEP")
 };
-static char access_fns[] = "CTLTABLINSPATANATNEXPLOGABSSQRINTRNDSGNLENTYPTIM"
+static const char access_fns[] = "CTLTABLINSPATANATNEXPLOGABSSQRINTRNDSGNLENTYPTIM"
 			   "SINCOSBRKITMRECNUMPOSCHRUPSSYS?32ZERCONIDNINVTRN";
-static char tsb2000f_fns[] = "?00TABLINSPATANATNEXPLOGABSSQRINTRNDSGNLENTYPTIM"
+static const char tsb2000f_fns[] = "?00TABLINSPATANATNEXPLOGABSSQRINTRNDSGNLENTYPTIM"
 			     "SINCOSBRK?23ZERCONIDNINVTRN?31?32?33?34?35?36?37";
 
 
-char *print_str_operand(SINK *snp, unsigned token, stmt_ctx_t *ctx)
+static void line_init(line_t *ln, SINK *snp)
+{
+	ln->ln_snp = snp;
+	ln->ln_bp = ln->ln_buf;
+}
+
+
+static void line_flush(line_t *ln)
+{
+	sink_write(ln->ln_snp, ln->ln_buf, ln->ln_bp - ln->ln_buf);
+	ln->ln_bp = ln->ln_buf;
+}
+
+
+/* ensure room for one token; returns where it goes */
+static char *line_room(line_t *ln)
+{
+	if (ln->ln_bp - ln->ln_buf > LINE_BUFSZ - LINE_TOKSZ)
+		line_flush(ln);
+	return ln->ln_bp;
+}
+
+
+/* n in decimal at bp; returns end */
+static char *put_uint(char *bp, unsigned n)
+{
+	char tmp[10], *tp = tmp + sizeof tmp;
+
+	do {
+		*--tp = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	memcpy(bp, tp, tmp + sizeof tmp - tp);
+	return bp + (tmp + sizeof tmp - tp);
+}
+
+
+static char *print_str_operand(line_t *ln, unsigned token, stmt_ctx_t *ctx)
 {
 	int len = token & 0xff;
 	int i, nread;
 	unsigned char c, *tbuf;
+	char *bp = ln->ln_bp;
 
 	if (len == 0) {
-		sink_printf(snp, "\"\"");
+		*bp++ = '"';
+		*bp++ = '"';
+		ln->ln_bp = bp;
 		return NULL;
 	}
 
@@ -228,44 +496,54 @@ char *print_str_operand(SINK *snp, unsigned token, stmt_ctx_t *ctx)
 		return "string extends past end of statement";
 
 	/* Access: use 'decimal notation for non-printable chars, quotes */
-	if (is_access > 0) {
+	if (ctx->st_ctx->pg_tsb->ts_access > 0) {
 		int inquote = 0;
 
 		for (i = 0; i < len; i++) {
 			c = tbuf[i];
 			if (c >= 32 && c < 127 && c != '"') {
 				if (!inquote)
-					sink_putc('"', snp);
+					*bp++ = '"';
 				inquote = 1;
-				sink_putc(c, snp);
+				*bp++ = c;
 			} else {
 				if (inquote)
-					sink_putc('"', snp);
+					*bp++ = '"';
 				inquote = 0;
-				sink_printf(snp, "'%d", c);
+				*bp++ = '\'';
+				bp = put_uint(bp, c);
 			}
 		}
 		if (inquote)
-			sink_putc('"', snp);
+			*bp++ = '"';
 
 	/* pre-Access: just print it */
 	} else {
-		sink_printf(snp, "\"%.*s\"", len, tbuf);
+		*bp++ = '"';
+		nread = strnlen((char *) tbuf, len);
+		memcpy(bp, tbuf, nread);
+		bp += nread;
+		*bp++ = '"';
 	}
 
+	ln->ln_bp = bp;
 	return NULL;
 }
 
 
-char *print_var_operand(SINK *snp, unsigned token)
+/* at *bpp, which is advanced */
+static char *print_var_operand(char **bpp, unsigned token)
 {
 	unsigned name = (token >> 4) & 0x1f;
 	unsigned type =  token       & 0xf;
+	char *bp = *bpp;
 
 	/* string variable with digit 0 or 1 */
 	if (name > 032) {
-		sink_printf(snp, "%c%d$", 'A' + ((token - 0xb0) & 0x1f),
-					  name > 034);
+		*bp++ = 'A' + ((token - 0xb0) & 0x1f);
+		*bp++ = '0' + (name > 034);
+		*bp++ = '$';
+		*bpp = bp;
 		return NULL;
 	}
 
@@ -273,29 +551,34 @@ char *print_var_operand(SINK *snp, unsigned token)
 	    case 0:			/* string variable */
 		if (!name)		/* null operand */
 			break;
-		sink_printf(snp, "%c$", '@' + name);
+		*bp++ = '@' + name;
+		*bp++ = '$';
 		break;
 
 	    case 1: case 2: case 3:	/* array variable */
 	    case 4:			/* simple variable, no digit */
-		sink_printf(snp, "%c", '@' + name);
+		*bp++ = '@' + name;
 		break;
 
 	    case 017:			/* user-defined function */
-		sink_printf(snp, "FN%c", '@' + name);
+		*bp++ = 'F';
+		*bp++ = 'N';
+		*bp++ = '@' + name;
 		break;
 
 	    default:			/* simple variable with digit 0-9 */
-		sink_printf(snp, "%c%d", '@' + name, type - 5);
+		*bp++ = '@' + name;
+		*bp++ = '0' + type - 5;
 		break;
 	}
 
+	*bpp = bp;
 	return NULL;
 }
 
 
-char *print_int_operand(SINK *snp, unsigned token, unsigned stmt,
-			stmt_ctx_t *ctx)
+static char *print_int_operand(line_t *ln, unsigned token, unsigned stmt,
+			       stmt_ctx_t *ctx)
 {
 	unsigned char *tbuf;
 	char *err = NULL;
@@ -303,23 +586,28 @@ char *print_int_operand(SINK *snp, unsigned token, unsigned stmt,
 
 	if (stmt_getbytes(ctx, &tbuf, 2) != 2)
 		return "value extends past end of statement";
-	sink_printf(snp, "%d", BE16(tbuf));
+	ln->ln_bp = put_uint(ln->ln_bp, BE16(tbuf));
 
 	if (is_dim || ((token >> 9) & 0x3f) == 043)	/* USING */
 		return err;
 
-	while (stmt_getbytes(ctx, &tbuf, 2) == 2)	/* GOTO/GOSUB OF */
-		sink_printf(snp, ",%d", BE16(tbuf));
+	while (stmt_getbytes(ctx, &tbuf, 2) == 2) {	/* GOTO/GOSUB OF */
+		*line_room(ln) = ',';
+		ln->ln_bp = put_uint(ln->ln_bp + 1, BE16(tbuf));
+	}
 
 	return err;
 }
 
 
-char *print_other_operand(SINK *snp, unsigned token)
+/* at *bpp, which is advanced */
+static char *print_other_operand(char **bpp, unsigned token,
+				 tsb_ctx_t *tsb)
 {
-	char *fns = is_access > 0 ? access_fns : tsb2000f_fns;
+	const char *fns = tsb->ts_access > 0 ? access_fns : tsb2000f_fns;
 	unsigned name = (token >> 4) & 0x1f;
 	unsigned type =  token       & 0xf;
+	char *bp = *bpp;
 
 	switch (type) {
 	    case 0: case 3:		/* handled elsewhere */
@@ -331,66 +619,79 @@ char *print_other_operand(SINK *snp, unsigned token)
 		break;
 
 	    case 4:			/* formal param, no digit */
-		sink_printf(snp, "%c", '@' + name);
+		*bp++ = '@' + name;
 		break;
 
 	    case 017:			/* built-in function */
-		sink_printf(snp, "%.3s", fns + 3 * name);
+		memcpy(bp, fns + 3 * name, 3);
+		bp += 3;
 		if (fns == access_fns && (name == 027 || name == 030))
-			sink_putc('$', snp);
+			*bp++ = '$';
 		break;
 
 	    default:			/* formal param with digit 0-9 */
-		sink_printf(snp, "%c%d", '@' + name, type - 5);
+		*bp++ = '@' + name;
+		*bp++ = '0' + type - 5;
 		break;
 	}
 
+	*bpp = bp;
 	return NULL;
 }
 
 
-char *print_stmt(SINK *snp, stmt_ctx_t *ctx)
+static char *detok_stmt(line_t *ln, stmt_ctx_t *ctx)
 {
 	unsigned char *tbuf;
-	char *err = NULL;
+	char *bp, *err = NULL;
 	int stmt = -1;
 	int nread;
-	char **opnames = is_access > 0 ? access_stmts : tsb2000f_ops;
+	tsb_ctx_t *tsb = ctx->st_ctx->pg_tsb;
+	const tok_name_t *opnames = tsb->ts_access > 0 ? access_stmts
+						       : tsb2000f_ops;
 
 	while (stmt_getbytes(ctx, &tbuf, 2) == 2) {
 		unsigned token = BE16(tbuf);
 		unsigned op = (token >> 9) & 0x3f;
-		char *space, *name = opnames[op];
+		const tok_name_t *tk = &opnames[op];
 
 		dprint(("print_stmt: 0x%04x <%d,0%02o,0%o,0%o>\n",
 			token, token >> 15, op,
 			(token >> 4) & 0x1f, token & 0xf));
-		space = name[0] && name[1] ? " " : "";
-		sink_printf(snp, "%s%s", space, name);
+		bp = line_room(ln);
+		if (tk->tk_space)
+			*bp++ = ' ';
+		memcpy(bp, tk->tk_name, tk->tk_len);
+		bp += tk->tk_len;
 
 		/* save statement code; process special cases */
 		if (stmt < 0) {
 			stmt = op;
 			switch (op) {
 			    case 070:		/* FILES */
-				sink_putc(' ', snp);
+				*bp++ = ' ';
 				/* fall thru */
 			    case 051:		/* REM */
 				if (token & 0xff)
-					sink_putc(token & 0xff, snp);
+					*bp++ = token & 0xff;
 				/* fall thru */
 			    case 044:		/* IMAGE */
+				ln->ln_bp = bp;
 				while (nread = stmt_getbytes(ctx,
 							&tbuf, 256)) {
 					if (!tbuf[nread-1])
 						nread--;
-					sink_write(snp, tbuf, nread);
+					bp = line_room(ln);
+					memcpy(bp, tbuf, nread);
+					ln->ln_bp = bp + nread;
 				}
 				goto next;
 			}
 		}
 
-		sink_printf(snp, "%s", space);
+		if (tk->tk_space)
+			*bp++ = ' ';
+		ln->ln_bp = bp;
 		if (token & 0x8000) {
 			unsigned type = token & 0xf;
 
@@ -400,24 +701,25 @@ char *print_stmt(SINK *snp, stmt_ctx_t *ctx)
 					      "end of statement";
 					break;
 				}
-				print_number(snp, tbuf);
+				ln->ln_bp += hpf_format(tbuf, ln->ln_bp);
 
 			} else if (type == 3)	/* line # or DIM */
-				err = print_int_operand(snp, token,
+				err = print_int_operand(ln, token,
 							stmt, ctx);
 
 			 else
-				err = print_other_operand(snp, token);
+				err = print_other_operand(&ln->ln_bp, token,
+							  tsb);
 
 		} else if (op == 1) {
-			err = print_str_operand(snp, token, ctx);
+			err = print_str_operand(ln, token, ctx);
 
 		} else {
-			err = print_var_operand(snp, token);
+			err = print_var_operand(&ln->ln_bp, token);
 		}
 next:
 		/* Access: subsequent operators aren't stmt codes */
-		if (is_access > 0)
+		if (tsb->ts_access > 0)
 			opnames = access_ops;
 
 		if (err)
@@ -428,16 +730,96 @@ next:
 }
 
 
+char *print_stmt(SINK *snp, stmt_ctx_t *ctx)
+{
+	line_t ln;
+	char *err;
+
+	line_init(&ln, snp);
+	err = detok_stmt(&ln, ctx);
+	line_flush(&ln);
+	return err;
+}
+
+
+/*
+ * CSAVEd programs refer to statements by address, and to variables by
+ * symbol table index. The table built here maps the word offset of each
+ * statement in the program text to its line number.
+ */
+typedef struct {
+	tsb_ctx_t	*cs_tsb;
+	int		*cs_lines;	/* line number, -1 if not a statement */
+	int		cs_nwords;
+	int		cs_start;	/* address of program text, in words */
+} csave_tab_t;
+
+
+/* returns NULL if ok */
+static char *csave_tab_init(csave_tab_t *cs, prog_ctx_t *prog, int start)
+{
+	unsigned char *buf;
+	int i, off, nwords;
+
+	memset(cs, 0, sizeof(csave_tab_t));
+	cs->cs_tsb = prog->pg_tsb;
+	cs->cs_start = start;
+	cs->cs_nwords = prog->pg_sz / 2;
+	if (!(cs->cs_lines = malloc((cs->cs_nwords + 1) * sizeof(int))))
+		return "out of memory for CSAVEd program";
+	for (i = 0; i < cs->cs_nwords; i++)
+		cs->cs_lines[i] = -1;
+
+	/* same statements as seen by stmt_init */
+	for (off = 0; off + 4 <= prog->pg_sz; off += 2 * nwords) {
+		(void) prog_getbytesat(prog, &buf, 4, off);
+		cs->cs_lines[off / 2] = BE16(buf);
+		if ((nwords = BE16(buf+2)) < 2) {
+			dprint(("csave_tab_init: length %d at %d\n", nwords,
+				off / 2));
+			return "corrupted statement length";
+		}
+	}
+	return NULL;
+}
+
+
+static void csave_tab_fini(csave_tab_t *cs)
+{
+	free(cs->cs_lines);
+	memset(cs, 0, sizeof(csave_tab_t));
+}
+
+
+/* replace destination address in tbuf with its line number */
+/* returns -1 if it isn't the address of a statement */
+static int csave_dest(csave_tab_t *cs, unsigned char *tbuf, int lineno)
+{
+	int off = BE16(tbuf) - cs->cs_start;
+
+	if (off < 0 || off >= cs->cs_nwords || cs->cs_lines[off] < 0) {
+		fprintf(out_msgf(cs->cs_tsb),
+			"line %d: corrupted destination %d\n", lineno, off);
+		return -1;
+	}
+	tbuf[0] = cs->cs_lines[off] >> 8;
+	tbuf[1] = cs->cs_lines[off];
+	return 0;
+}
+
+
 char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 {
 	prog_ctx_t save_prog;
 	stmt_ctx_t ctx;
-	int lineno;			/* for debugging */
+	csave_tab_t cs;
+	int lineno;
 	char *err = NULL;
-	unsigned char *buf;
+	unsigned char *buf, *syms;
 	int len = 2 * -(int16_t) BE16(dbuf+22);
-	int symptr = is_access > 0 ? 12 : 14;
+	int symptr = prog->pg_tsb->ts_access > 0 ? 12 : 14;
 	int symtab = 0;			/* offset in bytes */
+	int nsyms;			/* symtab entries, 4 bytes each */
 	int start = BE16(dbuf+8);	/* 16-bit words */
 
 	if (prog_getbytesat(prog, &buf, 2, len - symptr) == 2)
@@ -449,6 +831,16 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 	prog_setsz(prog, symtab);
 	save_prog = *prog;
 
+	/* only the first word of the last entry need be on tape */
+	nsyms = 0;
+	if (prog_getbytesat(prog, &syms, 2, symtab) == 2)
+		nsyms = (prog->pg_nread - symtab + 2) / 4;
+
+	if ((err = csave_tab_init(&cs, prog, start))) {
+		csave_tab_fini(&cs);
+		return err;
+	}
+
 	while ((lineno = stmt_init(&ctx, prog)) >= 0) {
 		unsigned char *tbuf;
 		int stmt = -1;
@@ -480,7 +872,6 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 			/* number, parameter, or built-in function */
 			if (token & 0x8000) {
 				unsigned type = token & 0xf;
-				int val;
 
 				/* FP number: consume and continue */
 				if (type == 0) {
@@ -508,17 +899,9 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 					continue;
 
 				/* else, replace with dest lineno */
-				val = BE16(tbuf);
-				if (prog_getbytesat(prog, &nbuf, 2,
-						    (val - start) * 2) == 2) {
-					tbuf[0] = nbuf[0];
-					tbuf[1] = nbuf[1];
-				} else {
-					dprint(("un_csave: dest %d\n",
-						val - start));
+				if (csave_dest(&cs, tbuf, lineno) < 0)
 					err = "corrupted destination "
 					      "line number";
-				}
 
 				/* USING: only one lineno, done */
 				if (op == 043) {
@@ -528,19 +911,10 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 
 				/* GOTO/GOSUB OF: replace all dest linenos */
 				dprint(("un_csave: GOTO OF\n"));
-				while (stmt_getbytes(&ctx, &tbuf, 2) == 2) {
-					val = BE16(tbuf);
-					if (prog_getbytesat(prog, &nbuf, 2,
-						     (val - start) * 2) == 2) {
-						tbuf[0] = nbuf[0];
-						tbuf[1] = nbuf[1];
-					} else {
-						dprint(("un_csave: dest %d\n",
-							val - start));
+				while (stmt_getbytes(&ctx, &tbuf, 2) == 2)
+					if (csave_dest(&cs, tbuf, lineno) < 0)
 						err = "corrupted destination "
 						      "line number";
-					}
-				}
 
 			/* string: consume even number of bytes */
 			} else if (op == 1) {
@@ -555,14 +929,12 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 			} else {
 				int idx = token & 0x1ff;
 
-				if (idx) {
-					if (prog_getbytesat(prog, &nbuf, 2,
-						  symtab + 4 * (idx-1)) == 2) {
-						tbuf[0] = (tbuf[0] & ~1) |
-							  (nbuf[0] & 1);
-						tbuf[1] = nbuf[1];
-					} else
-						err = "corrupted symbol table";
+				if (idx > nsyms)
+					err = "corrupted symbol table";
+				else if (idx) {
+					nbuf = syms + 4 * (idx-1);
+					tbuf[0] = (tbuf[0] & ~1) | (nbuf[0] & 1);
+					tbuf[1] = nbuf[1];
 				}
 			}
 		}
@@ -570,6 +942,8 @@ char *un_csave(prog_ctx_t *prog, unsigned char *dbuf)
 		stmt_fini(&ctx);
 	}
 
+	csave_tab_fini(&cs);
+
 	/* return to start of program */
 	*prog = save_prog;
 	return err;
@@ -584,100 +958,115 @@ char *extract_program(tfile_ctx_t *tfile, char *fn, char *oname,
 	int lineno, prev_lineno = 0;
 	char *err = NULL;
 	SINK *snp;
+	line_t ln;
 
 	dprint(("extract_program: %s\n", fn));
 
-	if (prog_init(&prog, tfile) < 0)
-		return "";
-
-	if (dbuf[6] & 0x80) {	/* CSAVEd */
+	/* only CSAVEd programs need to be read in whole */
+	if (dbuf[6] & 0x80) {
+		if (prog_init(&prog, tfile, 2 * -(int16_t) BE16(dbuf+22)) < 0)
+			return "";
 		err = un_csave(&prog, dbuf);
 		if (err) {
 			prog_fini(&prog);
 			return err;
 		}
-	} else
-		prog_setsz(&prog, 2 * -(int16_t) BE16(dbuf+22));
+	} else if (prog_stream(&prog, tfile, 2 * -(int16_t) BE16(dbuf+22)) < 0)
+		return "";
 
-	snp = out_open(fn, "bas", oname);
+	snp = out_open(tfile->tf_tsb, fn, "bas", oname);
 	if (!snp) {
 		prog_fini(&prog);
 		return "";
 	}
 
+	line_init(&ln, snp);
 	while ((lineno = stmt_init(&ctx, &prog)) >= 0) {
 
 		dprint(("extract_program: line %d\n", lineno));
 		if (lineno > 9999 || lineno <= prev_lineno) {
-			if (!ignore_errs) {
+			if (!tfile->tf_tsb->ts_ignerr) {
 				err = "lines out of order";
 				stmt_fini(&ctx);
 				break;
 			}
-			fprintf(sink_getf(snp),
-				"*** Warning: lines out of order -- "
-				"tape may be corrupted ***\n");
+			/* each line is flushed as it ends, so ln is empty */
+			sink_puts("*** Warning: lines out of order -- "
+				  "tape may be corrupted ***\n", snp);
 		}
-		sink_printf(snp, "%d ", lineno);
+		ln.ln_bp = put_uint(ln.ln_bp, lineno);
+		*ln.ln_bp++ = ' ';
 		prev_lineno = lineno;
 
-		err = print_stmt(snp, &ctx);
+		err = detok_stmt(&ln, &ctx);
 
-		sink_putc('\n', snp);
+		*line_room(&ln) = '\n';
+		ln.ln_bp++;
+		line_flush(&ln);
 		stmt_fini(&ctx);
 		if (err)
 			break;
 	}
+	if (lineno == -2)
+		err = "";
 
-	out_close(snp);
+	if (out_close(tfile->tf_tsb, snp) < 0 && !err)
+		err = "error writing output";
 	prog_fini(&prog);
 
 	return err;
 }
 
 
+/* op name for dump_program */
+static const char *dump_opname(const tok_name_t *opnames, unsigned op)
+{
+	/* replace some op names for clarity */
+	if (opnames != access_stmts) {
+		switch (op) {
+		    case 0:	return "(end)";		/* end of formula */
+		    case 1:	return "\"";
+		    case 4:	return "#(file)";
+		}
+	}
+	if (opnames != access_ops && op == 073)
+		return "(LET)";
+	if (opnames[op].tk_name[0] == '?')
+		return "";
+	return opnames[op].tk_name;
+}
+
+
 char *dump_program(tfile_ctx_t *tfile, char *fn, unsigned char *dbuf)
 {
+	tsb_ctx_t *tsb = tfile->tf_tsb;
 	SINK *snp;
 	prog_ctx_t prog;
 	unsigned char *buf;
+	char obuf[8], *bp;
 	unsigned off;
 	int start = BE16(dbuf+8);		/* 16-bit word offsets */
 	int len = -(int16_t) BE16(dbuf+22);
 	int symtab = len;
-	int symptr = is_access > 0 ? 12 : 14;	/* byte offset */
+	int symptr = tsb->ts_access > 0 ? 12 : 14;	/* byte offset */
 	int i, uid = BE16(dbuf);
 	int nused = 0, nleft = 0;		/* words in statement */
 
 	dprint(("dump_program: %s\n", fn));
 
-	printf("\n%c%03d/", '@' + (uid >> 10), uid & 0x3ff);
-	print_direntry(dbuf);
-	printf(" start=0x%04x ldr=0x%04x disk=0x%04x%04x\n",
+	fprintf(tsb->ts_out, "\n%c%03d/", '@' + (uid >> 10), uid & 0x3ff);
+	print_direntry(tsb, dbuf);
+	fprintf(tsb->ts_out, " start=0x%04x ldr=0x%04x disk=0x%04x%04x\n",
 	       start, BE16(dbuf+20), BE16(dbuf+16), BE16(dbuf+18));
 
-	if (prog_init(&prog, tfile) < 0)
+	if (prog_init(&prog, tfile, len * 2) < 0)
 		return "";
 	if (prog_getbytesat(&prog, &buf, 2, len*2 - symptr) == 2)
 		symtab = BE16(buf) - start;
 	if (symtab < 0 || symtab > len)
 		symtab = len;
 
-	snp = sink_initf(stdout);
-
-	/* replace some op names for clarity */
-	for (i = 0; i < 0100; i++) {
-		if (tsb2000f_ops[i][0] == '?')
-			tsb2000f_ops[i] = "";
-		if (access_ops[i][0] == '?')
-			access_ops[i] = "";
-		if (access_stmts[i][0] == '?')
-			access_stmts[i] = "";
-	}
-	access_ops[0] = tsb2000f_ops[0] = "(end)";	/* end of formula */
-	access_ops[1] = tsb2000f_ops[1] = "\"";
-	access_ops[4] = tsb2000f_ops[4] = "#(file)";
-	access_stmts[073] = tsb2000f_ops[073] = "(LET)";
+	snp = sink_initf(tsb->ts_out);
 
 	for (off = 0; prog_getbytes(&prog, &buf, 2) == 2; off++) {
 		unsigned val = BE16(buf);
@@ -701,7 +1090,7 @@ char *dump_program(tfile_ctx_t *tfile, char *fn, unsigned char *dbuf)
 
 		/* offset */
 		if (off & 0x7)
-			sink_printf(snp, "     ");
+			sink_puts("     ", snp);
 		else
 			sink_printf(snp, "%5x", off);
 
@@ -732,45 +1121,52 @@ char *dump_program(tfile_ctx_t *tfile, char *fn, unsigned char *dbuf)
 			pfx = "\033[4m";
 			sfx = "\033[0m";
 		}
-		if (is_access > 0)
-			sink_printf(snp, "%s%-7s%s|%-7s", pfx, access_stmts[op],							  sfx, access_ops[op]);
+		if (tsb->ts_access > 0)
+			sink_printf(snp, "%s%-7s%s|%-7s", pfx,
+				    dump_opname(access_stmts, op), sfx,
+				    dump_opname(access_ops, op));
 		else
-			sink_printf(snp, "%s%-7s%s", pfx, tsb2000f_ops[op], sfx);
+			sink_printf(snp, "%s%-7s%s", pfx,
+				    dump_opname(tsb2000f_ops, op), sfx);
 
 		/* contents as operand */
-		sink_printf(snp, "  ");
+		sink_puts("  ", snp);
 		if (val & 0x8000) {
 			switch (type) {
 			    case 0:
-				sink_printf(snp, "(num)");
+				sink_puts("(num)", snp);
 				break;
 
 			    case 3:
-				sink_printf(snp, "(int)");
+				sink_puts("(int)", snp);
 				break;
 
 			    default:
 				if (!name) {
 					/* fn param */
-					sink_printf(snp, "(par)");
+					sink_puts("(par)", snp);
 					break;
 				}
 				/* fall thru */
 			    case 017:
-				(void) print_other_operand(snp, val);
+				bp = obuf;
+				(void) print_other_operand(&bp, val, tsb);
+				sink_write(snp, obuf, bp - obuf);
 				break;
 			}
 		} else if (op == 1) {
-			sink_printf(snp, "(str)");
+			sink_puts("(str)", snp);
 		} else {
 			if (name) {
-				(void) print_var_operand(snp, val);
+				bp = obuf;
+				(void) print_var_operand(&bp, val);
+				sink_write(snp, obuf, bp - obuf);
 				if (type > 0 && type < 4)
-					sink_printf(snp, "[]");
+					sink_puts("[]", snp);
 			} else if (type)
-				sink_printf(snp, "(@var)");
+				sink_puts("(@var)", snp);
 			else
-				sink_printf(snp, "     ");
+				sink_puts("     ", snp);
 		}
 
 		/* contents as FP number */
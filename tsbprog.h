@@ -23,13 +23,22 @@
 #define _TSBPROG_H 1
 
 typedef struct {
+	struct tsb_ctx	*pg_tsb;	/* tape being decoded */
 	unsigned char	*pg_buf;
 	unsigned char	*pg_bp;		/* sequential read position */
+	int		pg_bufsz;
 	int		pg_sz;		/* program text w/out symtab */
 	int		pg_nread;	/* total read from tape */
+	tfile_ctx_t	*pg_tfile;	/* if streaming: tape file being read */
+	int		pg_left;	/* if streaming: text left, -1 if unknown */
 } prog_ctx_t;
 
-extern int prog_init(prog_ctx_t *prog, tfile_ctx_t *tfile);
+typedef struct prog_pool prog_pool_t;
+
+extern prog_pool_t *prog_pool_init(void);
+extern void prog_pool_fini(prog_pool_t *pp);
+extern int prog_init(prog_ctx_t *prog, tfile_ctx_t *tfile, int szhint);
+extern int prog_stream(prog_ctx_t *prog, tfile_ctx_t *tfile, int nbytes);
 extern void prog_setsz(prog_ctx_t *prog, int nbytes);
 extern int prog_nleft(prog_ctx_t *prog);
 extern int prog_getbytes(prog_ctx_t *prog, unsigned char **bufp, int nbytes);
@@ -36,216 +36,728 @@
 #include "convert.h"
 #include "tsbfile.h"
 #include "tsbprog.h"
+#include "tapindex.h"
+#include "workq.h"
+#include "xstate.h"
+#include "catalog.h"
+#include "match.h"
+#include "hpfloat.h"
 #include "tsbtap.h"
 
 
-int is_access = -1;
-int ignore_errs = 0;
 int debug = 0;
-int verbose = 0;
+int njobs = 1;
 
 
 /*
  * -r: show raw tape block structure.
+ *
+ * Rows are formatted from tables into a buffer, and each block's dump
+ * written out in one piece; with -vv a whole image is dumped, and
+ * formatting it a byte at a time with stdio is slow.
  */
 
-int do_ropt(TAPE *tap)
+#define DUMP_BUFSZ	65536
+#define DUMP_ROWSZ	256	/* most a row (or block header) can take */
+
+typedef struct {
+	char	dt_hex[256][2];
+	struct {
+		char	g_len;
+		char	g_str[10];	/* e.g. "\033[4mA\033[0m", and NUL */
+	} dt_glyph[256];
+} dump_tab_t;
+
+
+static void dump_init(dump_tab_t *dt)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		dt->dt_hex[i][0] = hex[i >> 4];
+		dt->dt_hex[i][1] = hex[i & 0xf];
+
+		c = i;
+		if ((c & 0x7f) < 32 || (c & 0x7f) == 127)
+			c = '.';
+		if (c & 0x80) {
+			c &= 0x7f;
+			if (c == ' ' || c >= 'A' && c <= 'Z' ||
+			    c >= '0' && c <= '9') {
+				/* ul */
+				dt->dt_glyph[i].g_len =
+				    sprintf(dt->dt_glyph[i].g_str,
+					    "\033[4m%c\033[0m", c);
+				continue;
+			}
+			c = '.';
+		}
+		dt->dt_glyph[i].g_str[0] = c;
+		dt->dt_glyph[i].g_len = 1;
+	}
+}
+
+
+/* format n (<= 16) bytes at off in block as one row */
+/* returns end of row in bp */
+static char *dump_row(dump_tab_t *dt, char *bp, unsigned char *row, int n,
+		      int off)
+{
+	int j;
+
+	/* 16 bytes as hex */
+	for (j = 0; j < 16; j++) {
+		if (j < n) {
+			bp[0] = dt->dt_hex[row[j]][0];
+			bp[1] = dt->dt_hex[row[j]][1];
+		} else
+			bp[0] = bp[1] = ' ';
+		bp += 2;
+		if (j % 2 == 1)
+			*bp++ = ' ';
+		if (j % 8 == 7)
+			*bp++ = ' ';
+	}
+
+	/* 16 bytes as ASCII */
+	for (j = 0; j < 16; j++) {
+		if (j < n) {
+			memcpy(bp, dt->dt_glyph[row[j]].g_str,
+			       dt->dt_glyph[row[j]].g_len);
+			bp += dt->dt_glyph[row[j]].g_len;
+		} else
+			*bp++ = ' ';
+		if (j % 8 == 7)
+			*bp++ = ' ';
+	}
+
+	if (off % 64 == 0)
+		bp += sprintf(bp, " 0x%x", off);
+	*bp++ = '\n';
+	return bp;
+}
+
+
+/* dump blocks to end of tape, using DUMP_BUFSZ bytes at buf */
+/* returns 2 if error, else 0 */
+static int dump_blocks(tsb_ctx_t *tsb, TAPE *tap, FILE *fp, dump_tab_t *dt,
+		       char *buf)
 {
 	ssize_t nbytes;
-	int i, j, lim, ec = 0;
-	unsigned char *tbuf, c;
-	char *sfx;
+	int i, lim;
+	unsigned char *tbuf;
+	char *bp;
 
 	while (1) {
 		nbytes = tap_readblock(tap, (char **) &tbuf);
-		if (nbytes < 0) {
-			if (nbytes == -2)
-				ec = 2;
-			break;
-		}
+		if (nbytes < 0)
+			return nbytes == -2 ? 2 : 0;
 		if (nbytes == 0) {
-			printf("  --mark--\n");
+			fprintf(fp, "  --mark--\n");
 			continue;
 		}
 
-		switch (verbose) {
+		switch (tsb->ts_verbose) {
 		    case 0:   lim = 32; break;
 		    case 1:   lim = 128; break;
 		    default:  lim = nbytes; break;
 		}
 		lim = MIN(nbytes, lim);
 
-		printf("%6ld  ", nbytes);
+		bp = buf + sprintf(buf, "%6ld  ", nbytes);
 		for (i = 0; i < lim; i += 16) {
-			if (i)
-				printf("        ");
-
-			/* print 16 bytes as hex */
-			for (j = 0; j < 16; j++) {
-				if (i+j < lim)
-					printf("%02x", tbuf[i+j]);
-				else
-					printf("  ");
-				if (j % 2 == 1)
-					putchar(' ');
-				if (j % 8 == 7)
-					putchar(' ');
+			if (bp - buf > DUMP_BUFSZ - DUMP_ROWSZ) {
+				fwrite(buf, 1, bp - buf, fp);
+				bp = buf;
 			}
-
-			/* print 16 bytes as ASCII */
-			for (j = 0; j < 16; j++) {
-				if (i+j < lim) {
-					sfx = "";
-					c = tbuf[i+j];
-					if ((c & 0x7f) < 32 ||
-					    (c & 0x7f) == 127)
-						c = '.';
-					if (c & 0x80) {
-						c &= 0x7f;
-						if (c == ' ' ||
-						    c >= 'A' && c <= 'Z' ||
-						    c >= '0' && c <= '9') {
-							/* ul */
-							printf("\033[4m");
-							sfx = "\033[0m";
-						} else
-							c = '.';
-					}
-					printf("%c%s", c, sfx);
-				} else
-					putchar(' ');
-				if (j % 8 == 7)
-					putchar(' ');
+			if (i) {
+				memset(bp, ' ', 8);
+				bp += 8;
 			}
+			bp = dump_row(dt, bp, tbuf + i, MIN(lim - i, 16), i);
+		}
+		fwrite(buf, 1, bp - buf, fp);
+	}
+}
+
+
+/*
+ * With -j, the image is cut into runs of blocks by reading just their
+ * length words. Workers format each run into its own buffer, from a view
+ * of the mapped image, and the main thread writes the buffers in order.
+ * As with -x, messages about bad blocks come from the main thread.
+ */
 
-			if (i % 64 == 0)
-				printf(" 0x%x", i);
-			putchar('\n');
+#define DUMP_RUNSZ	(1024 * 1024)	/* bytes of image per run */
+
+typedef struct {
+	tsb_ctx_t	*dj_tsb;
+	TAPE		*dj_tap;	/* view of run's blocks */
+	dump_tab_t	*dj_dt;
+	char		*dj_out;
+	size_t		dj_outlen;
+	int		dj_ec;
+} dump_job_t;
+
+
+static void run_dump_job(void *arg)
+{
+	dump_job_t *job = arg;
+	FILE *fp;
+	char *buf;
+
+	buf = malloc(DUMP_BUFSZ);
+	fp = open_memstream(&job->dj_out, &job->dj_outlen);
+	if (!buf || !fp) {
+		fprintf(stderr, "Out of memory\n");
+		job->dj_ec = 2;
+	} else
+		(void) dump_blocks(job->dj_tsb, job->dj_tap, fp, job->dj_dt,
+				   buf);
+	if (fp)
+		fclose(fp);
+	free(buf);
+}
+
+
+/* returns 2 if error, else 0 */
+static int commit_dump_job(dump_job_t *job)
+{
+	int ec = job->dj_ec;
+
+	if (job->dj_out)
+		fwrite(job->dj_out, 1, job->dj_outlen, job->dj_tsb->ts_out);
+	free(job->dj_out);
+	tap_close(job->dj_tap);
+	free(job);
+	return ec;
+}
+
+
+/* returns 2 if error, else 0 */
+static int dump_parallel(tsb_ctx_t *tsb, TAPE *tap, dump_tab_t *dt,
+			 workq_t *wq)
+{
+	ssize_t nbytes;
+	off_t start, prev, end;
+	dump_job_t *job;
+	int ec = 0;
+
+	do {
+		/* find end of run */
+		start = tap_tell(tap);
+		do {
+			prev = tap_tell(tap);
+			nbytes = tap_skipblock(tap, 1);
+		} while (nbytes >= 0 && tap_tell(tap) - start < DUMP_RUNSZ);
+		end = nbytes == -2 ? prev : tap_tell(tap);
+		if (nbytes == -2)
+			ec = 2;
+		if (end <= start)
+			break;
+
+		job = malloc(sizeof(dump_job_t));
+		if (job) {
+			memset(job, 0, sizeof(dump_job_t));
+			job->dj_tap = tap_openview(tap, start, end);
 		}
+		if (!job || !job->dj_tap) {
+			fprintf(stderr, "Out of memory\n");
+			free(job);
+			ec = 2;
+			break;
+		}
+		job->dj_tsb = tsb;
+		job->dj_dt = dt;
+
+		/* limit output held in memory */
+		while (workq_pending(wq) >= 2 * wq->wq_nthreads)
+			if (commit_dump_job(workq_next(wq)))
+				ec = 2;
+
+		if (workq_submit(wq, run_dump_job, job) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			tap_close(job->dj_tap);
+			free(job);
+			ec = 2;
+			break;
+		}
+	} while (nbytes >= 0);
+
+	while (job = workq_next(wq))
+		if (commit_dump_job(job))
+			ec = 2;
+	return ec;
+}
+
+
+int do_ropt(tsb_ctx_t *tsb, TAPE *tap)
+{
+	dump_tab_t dt;
+	workq_t *wq;
+	char *buf;
+	int ec;
+
+	dump_init(&dt);
+
+	/* workers need a mapped image to read from */
+	if (njobs > 1 && tap_is_mapped(tap) && (wq = workq_init(njobs))) {
+		ec = dump_parallel(tsb, tap, &dt, wq);
+		workq_fini(wq);
+		return ec;
 	}
 
+	if (!(buf = malloc(DUMP_BUFSZ))) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+	ec = dump_blocks(tsb, tap, tsb->ts_out, &dt, buf);
+	free(buf);
 	return ec;
 }
 
 
 /*
- * -d: show tokens of TSB program.
+ * Visit files on tape matching command-line names, for -d and -x.
  */
 
-int is_tsb_label(unsigned char *tbuf, int nbytes)
+/* nbuf: id, name: file name, fn: matched name, pattern: matching arg */
+typedef int (*file_op_t)(tfile_ctx_t *tfile, unsigned char *dbuf, char *nbuf,
+			 char *name, char *fn, char *pattern);
+
+
+/* id returned in nbuf, file name in name */
+/* returns matched name (see name_match), NULL if no match */
+static char *match_direntry(unsigned char *dbuf, char *nbuf, char *name,
+			    matcher_t *m, int *ip)
 {
-	if (nbytes >= 20 &&			/* long enough? */
-	    (tbuf[0] >> 2) > 26 &&		/* not a valid id (> Z)? */
-	    memcmp(tbuf+2, "LBTS", 4) == 0) {	/* name as expected? */
-		if (is_access < 0)
-			is_access = BE16(tbuf+16) >= SYSLVL_ACCESS;
+	int i;
+	unsigned uid;
+
+	/* get id and name */
+	uid = BE16(dbuf);
+	sprintf(nbuf, "%c%03d", '@' + (uid >> 10), uid & 0x3ff);
+	for (i = 0; i < 6; i++) {
+		name[i] = dbuf[i+2] & 0x7f;
+		if (name[i] == ' ')
+			break;
+	}
+	name[i] = '\0';
+
+	return match_find(m, nbuf, name, ip);
+}
+
+
+/* handle file starting with block in tbuf */
+/* index of matching arg returned in *ip, -1 if none */
+/* returns 2 if error, else 0 */
+static int do_file(tsb_ctx_t *tsb, TAPE *tap, unsigned char *tbuf,
+		   ssize_t nread, matcher_t *m, file_op_t op, int *ip)
+{
+	unsigned char sbuf[24], *dbuf;
+	char *fn;
+	char nbuf[12], name[7];
+	int i, nbytes, ec = 0;
+	tfile_ctx_t tfile;
+
+	*ip = -1;
+
+	/* skip TSB labels */
+	if (is_tsb_label(tsb, tbuf, nread)) {
+		tfile_ctx_init(&tfile, tsb, tap, tbuf, nread, 0);
+		goto next;
+	}
+
+	tfile_ctx_init(&tfile, tsb, tap, tbuf, nread,
+		       tsb->ts_access > 0 ? 0 : 2);
+	nbytes = tfile_span(&tfile, (char **) &dbuf, 24, (char *) sbuf);
+	if (nbytes < 24)	/* skip short block */
+		goto next;
+
+	/* op reads on; keep the entry if its block can be overwritten */
+	if (dbuf != sbuf && !tap_is_mapped(tap))
+		dbuf = memcpy(sbuf, dbuf, 24);
+
+	fn = match_direntry(dbuf, nbuf, name, m, &i);
+	if (!fn) /* no match */
+		goto next;
+	*ip = i;
+
+	ec = op(&tfile, dbuf, nbuf, name, fn, m->mt_argv[i]);
+
+next:
+	tfile_skipf(&tfile);
+	tfile_ctx_fini(&tfile);
+	return ec;
+}
+
+
+/*
+ * -I: a file whose directory entry and blocks on tape are the same as when
+ * it was last extracted, and whose output is untouched, is skipped before
+ * it is decoded. Its blocks are hashed from the mapped image.
+ */
+
+/* key->xk_tape set if file is tracked, NULL if not */
+/* returns 1 if unchanged (tape left after file), -1 if error, else 0 */
+static int inc_check(tsb_ctx_t *tsb, TAPE *tap, unsigned char *tbuf,
+		     ssize_t nread, matcher_t *m, xs_key_t *key)
+{
+	unsigned char *dbuf = tbuf + (tsb->ts_access > 0 ? 0 : 2);
+	char nbuf[12], *bp;
+	off_t boff = tap_tell(tap);
+	SINK *snp;
+	int i;
+
+	memset(key, 0, sizeof(xs_key_t));
+	if (!tsb->ts_state || !tap_is_mapped(tap) ||
+	    is_tsb_label(tsb, tbuf, nread) ||
+	    nread < (dbuf - tbuf) + 24 ||
+	    !match_direntry(dbuf, nbuf, key->xk_name, m, &i))
+		return 0;
+
+	if (!(snp = sink_inithash())) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	sink_write(snp, (char *) tbuf, nread);
+	while ((nread = tap_readblock(tap, &bp)) > 0)
+		sink_write(snp, bp, nread);
+	key->xk_src = sink_hashval(snp);
+	sink_fini(snp);
+	if (nread == -2)
+		return -1;
+
+	key->xk_tape = tsb->ts_tapeid;
+	strcpy(key->xk_uid, nbuf);
+	key->xk_len = BE16(dbuf+22);
+	key->xk_adate = BE16(dbuf+10);
+
+	if (xs_lookup(tsb->ts_state, key)) {
+		dprint(("inc_check: %s/%s unchanged\n", nbuf, key->xk_name));
+		match_found(m, i);
 		return 1;
 	}
 
+	/* changed: its old output makes way for the new */
+	if (key->xk_prevout)
+		out_remove(tsb, key->xk_prevout);
+	if (tap_seek(tap, boff) < 0) {
+		fprintf(stderr, "%s: can't seek to 0x%lx\n", tap->tp_path,
+			(long) boff);
+		return -1;
+	}
 	return 0;
 }
 
 
-int do_dopt(TAPE *tap, int argc, char **argv)
+/* record where file went, if it was extracted without error */
+static void inc_done(tsb_ctx_t *tsb, xs_key_t *key, int ec)
+{
+	if (ec == 0 && tsb->ts_outname)
+		(void) xs_record(tsb->ts_state, key, tsb->ts_outname);
+	free(tsb->ts_outname);
+	tsb->ts_outname = NULL;
+}
+
+
+/*
+ * With -j, each file is handed to a worker thread as a view of its
+ * blocks in the mapped image. The main thread finds where each file
+ * ends and commits the output of finished files in tape order, so
+ * that file names and messages are the same as when run serially.
+ */
+
+typedef struct {
+	tsb_ctx_t	*fj_tsb;
+	TAPE		*fj_tap;	/* view of file's blocks */
+	matcher_t	*fj_matcher;	/* file name patterns */
+	file_op_t	fj_op;
+	int		fj_ec;
+	int		fj_match;	/* matching arg, -1 if none */
+	out_defer_t	fj_out;
+	xs_key_t	fj_key;		/* -I: xk_tape NULL if not tracked */
+} file_job_t;
+
+
+static void run_file_job(void *arg)
+{
+	file_job_t *job = arg;
+	unsigned char *tbuf;
+	ssize_t nread;
+
+	if (out_defer_begin(&job->fj_out) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		job->fj_ec = 2;
+		return;
+	}
+
+	nread = tap_readblock(job->fj_tap, (char **)&tbuf);
+	if (nread > 0)
+		job->fj_ec = do_file(job->fj_tsb, job->fj_tap, tbuf, nread,
+				     job->fj_matcher, job->fj_op,
+				     &job->fj_match);
+
+	out_defer_end(&job->fj_out);
+}
+
+
+/* returns 2 if error, else 0 */
+static int commit_file_job(file_job_t *job)
+{
+	int ec = job->fj_ec;
+
+	if (out_defer_commit(job->fj_tsb, &job->fj_out) < 0)
+		ec = 2;
+	if (job->fj_key.xk_tape)
+		inc_done(job->fj_tsb, &job->fj_key, ec);
+	if (job->fj_match >= 0)
+		match_found(job->fj_matcher, job->fj_match);
+
+	tap_close(job->fj_tap);
+	free(job);
+	return ec;
+}
+
+
+/* handle file at offset off, starting with block in tbuf */
+/* wq: worker pool, NULL to handle it now */
+/* returns 2 if error, 1 if skipped by -I, else 0 */
+static int visit_file(tsb_ctx_t *tsb, workq_t *wq, TAPE *tap, off_t off,
+		      unsigned char *tbuf, ssize_t nread,
+		      matcher_t *m, file_op_t op)
+{
+	char nbuf[12], name[7];
+	int i, ec = 0, hdr = tsb->ts_access > 0 ? 0 : 2;
+	tfile_ctx_t tfile;
+	file_job_t *job;
+	xs_key_t key;
+
+	switch (inc_check(tsb, tap, tbuf, nread, m, &key)) {
+	    case -1:	return 2;
+	    case 1:	return 1;
+	}
+
+	if (!wq) {
+		ec = do_file(tsb, tap, tbuf, nread, m, op, &i);
+		if (i >= 0)
+			match_found(m, i);
+		if (key.xk_tape)
+			inc_done(tsb, &key, ec);
+		return ec;
+	}
+
+	/* labels (which may set ts_access), and files that can't match */
+	if (is_tsb_label(tsb, tbuf, nread) ||
+	    (nread >= hdr + 24 &&
+	     !match_direntry(tbuf + hdr, nbuf, name, m, &i))) {
+		tfile_ctx_init(&tfile, tsb, tap, tbuf, nread, 0);
+		tfile_skipf(&tfile);
+		tfile_ctx_fini(&tfile);
+		return 0;
+	}
+
+	/* find end of file */
+	tfile_ctx_init(&tfile, tsb, tap, tbuf, nread, 0);
+	tfile_skipf(&tfile);
+	tfile_ctx_fini(&tfile);
+
+	job = malloc(sizeof(file_job_t));
+	if (!job) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+	memset(job, 0, sizeof(file_job_t));
+	job->fj_tap = tap_openview(tap, off, tap_tell(tap));
+	if (!job->fj_tap) {
+		fprintf(stderr, "Out of memory\n");
+		free(job);
+		return 2;
+	}
+	job->fj_tsb = tsb;
+	job->fj_matcher = m;
+	job->fj_op = op;
+	job->fj_match = -1;
+	job->fj_key = key;
+
+	/* limit output held in memory */
+	while (workq_pending(wq) >= 2 * wq->wq_nthreads)
+		if (commit_file_job(workq_next(wq)))
+			ec = 2;
+
+	if (workq_submit(wq, run_file_job, job) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		tap_close(job->fj_tap);
+		free(job);
+		return 2;
+	}
+	return ec;
+}
+
+
+/* read whole tape, or only matching files if indexed */
+/* nthreads: number of files to handle at once */
+static int each_file(tsb_ctx_t *tsb, TAPE *tap, tap_index_t *idx,
+		     int argc, char **argv, file_op_t op, int nthreads)
 {
-	int i, ec = 0;
+	int i, rv, ec = 0, nskip = 0;
+	off_t off;
 	ssize_t nread;
 	unsigned char *tbuf;
-	char *found;
+	workq_t *wq = NULL;
+	file_job_t *job;
+	matcher_t *m;
 
-	found = alloca(argc);
-	if (!found) {
-		fprintf(stderr, "too many file names\n");
+	m = match_init(argc, argv, tsb->ts_nexcl, tsb->ts_excl);
+	if (!m) {
+		fprintf(stderr, "Out of memory\n");
 		return 3;
 	}
-	memset(found, 0, argc);
 
-	while ((nread = tap_readblock(tap, (char **)&tbuf)) >= 0) {
-		unsigned char dbuf[24];
-		char *err, *fn;
-		char nbuf[12], name[7];
-		unsigned uid;
-		int nbytes;
-		tfile_ctx_t tfile;
+	/* workers need a mapped image to read from */
+	if (nthreads > 1 && tap_is_mapped(tap)) {
+		wq = workq_init(nthreads);
+		if (!wq)
+			dprint(("each_file: no worker threads\n"));
+	}
 
-		/* skip tapemarks */
-		if (nread == 0)
-			continue;
+	if (idx) {
+		idx_entry_t *ent;
 
-		/* skip TSB labels */
-		if (is_tsb_label(tbuf, nread)) {
-			tfile_ctx_init(&tfile, tap, tbuf, nread, 0);
-			goto next;
-		}
+		for (ent = idx->ix_ent; ent < idx->ix_ent + idx->ix_nent;
+		     ent++) {
+			char nbuf[12], name[7];
 
-		tfile_ctx_init(&tfile, tap, tbuf, nread, is_access > 0 ? 0 : 2);
-		nbytes = tfile_getbytes(&tfile, dbuf, 24);
-		if (nbytes < 24)	/* skip short block */
-			goto next;
+			/* don't read files that can't match */
+			if ((ent->ie_flags & IE_DIRENT) &&
+			    !match_direntry(ent->ie_dbuf, nbuf, name, m, &i))
+				continue;
 
-		/* get id and name */
-		uid = BE16(dbuf);
-		sprintf(nbuf, "%c%03d", '@' + (uid >> 10), uid & 0x3ff);
-		for (i = 0; i < 6; i++) {
-			name[i] = dbuf[i+2] & 0x7f;
-			if (name[i] == ' ')
+			if (tap_seek(tap, ent->ie_off) < 0) {
+				fprintf(stderr, "%s: can't seek to 0x%lx\n",
+					tap->tp_path, ent->ie_off);
+				ec = 2;
+				break;
+			}
+			nread = tap_readblock(tap, (char **)&tbuf);
+			if (nread <= 0) {
+				fprintf(stderr, "%s: index out of date?\n",
+					tap->tp_path);
+				ec = 2;
 				break;
+			}
+
+			rv = visit_file(tsb, wq, tap, ent->ie_off, tbuf, nread,
+					m, op);
+			if (rv == 2)
+				ec = 2;
+			else if (rv)
+				nskip++;
 		}
-		name[i] = '\0';
 
-		/* check for match */
-		for (i = 0; i < argc; i++)
-			if (fn = name_match(argv[i], nbuf, name))
-				break;
-		if (i == argc) /* no match */
-			goto next;
-		found[i] = 1;
-		err = NULL;
+	} else {
+		while (off = tap_tell(tap),
+		       (nread = tap_readblock(tap, (char **)&tbuf)) >= 0) {
+			/* skip tapemarks */
+			if (nread == 0)
+				continue;
 
-		/* matched */
-		if (dbuf[4] & 0x80)
-			printf("Not dumping %s/%s\n", nbuf, name);
-		else
-			err = dump_program(&tfile, fn, dbuf);
+			rv = visit_file(tsb, wq, tap, off, tbuf, nread, m, op);
+			if (rv == 2)
+				ec = 2;
+			else if (rv)
+				nskip++;
+		}
 
-		if (err) {
+		if (nread == -2)
 			ec = 2;
-			if (err[0])
-				printf("%s: %s\n", fn, err);
-		}
+	}
 
-next:
-		tfile_skipf(&tfile);
-		tfile_ctx_fini(&tfile);
+	if (wq) {
+		while (job = workq_next(wq))
+			if (commit_file_job(job))
+				ec = 2;
+		workq_fini(wq);
 	}
 
-	if (nread == -2)
-		ec = 2;
+	if (nskip)
+		fprintf(tsb->ts_out, "%d unchanged file%s skipped\n", nskip,
+			nskip == 1 ? "" : "s");
 
-	for (i = 0; i < argc; i++)
-		if (!found[i]) {
-			fprintf(stderr, "%s not found\n", argv[i]);
-			ec = 3;
-		}
+	if (m->mt_nfound < argc)
+		for (i = 0; i < argc; i++)
+			if (!m->mt_found[i]) {
+				fprintf(stderr, "%s not found\n", argv[i]);
+				ec = 3;
+			}
+	match_free(m);
 	return ec;
 }
 
 
+/*
+ * -d: show tokens of TSB program.
+ */
+
+int is_tsb_label(tsb_ctx_t *tsb, unsigned char *tbuf, int nbytes)
+{
+	if (nbytes >= 20 &&			/* long enough? */
+	    (tbuf[0] >> 2) > 26 &&		/* not a valid id (> Z)? */
+	    memcmp(tbuf+2, "LBTS", 4) == 0) {	/* name as expected? */
+		if (tsb->ts_access < 0)
+			tsb->ts_access = BE16(tbuf+16) >= SYSLVL_ACCESS;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int dopt_file(tfile_ctx_t *tfile, unsigned char *dbuf, char *nbuf,
+		     char *name, char *fn, char *pattern)
+{
+	char *err = NULL;
+	FILE *fp = tfile->tf_tsb->ts_out;
+
+	if (dbuf[4] & 0x80)
+		fprintf(fp, "Not dumping %s/%s\n", nbuf, name);
+	else
+		err = dump_program(tfile, fn, dbuf);
+
+	if (err) {
+		if (err[0])
+			fprintf(fp, "%s: %s\n", fn, err);
+		return 2;
+	}
+	return 0;
+}
+
+
+int do_dopt(tsb_ctx_t *tsb, TAPE *tap, tap_index_t *idx, int argc,
+	    char **argv)
+{
+	return each_file(tsb, tap, idx, argc, argv, dopt_file, 1);
+}
+
+
 /*
  * -t: catalog the tape.
  */
 
 static char mos[] = "JanFebMarAprMayJunJulAugSepOctNovDec???";
 
-void print_date(int yr, int jday)
+void print_date(FILE *fp, int yr, int jday)
 {
 	struct tm tm;
 
 	if (jdate_to_tm(yr, jday, &tm) < 0) {
-		printf("??-????-%4d", yr+1900);
+		fprintf(fp, "??-????-%4d", yr+1900);
 		return;
 	}
-	printf("%2d-%.3s-%4d", tm.tm_mday, mos + 3*tm.tm_mon, tm.tm_year+1900);
+	fprintf(fp, "%2d-%.3s-%4d", tm.tm_mday, mos + 3*tm.tm_mon,
+		tm.tm_year+1900);
 }
 
 
@@ -259,89 +771,197 @@ char *device_str(char *buf, unsigned char *dbuf)
 }
 
 
-void print_direntry(unsigned char *dbuf)
+/* directory entry, decoded */
+typedef struct {
+	int		de_uid;
+	char		de_name[7];	/* trailing blanks removed */
+	char		de_type;	/* F, C, A, M, or blank for BASIC */
+	char		de_mode;	/* U, P, L, or blank */
+	char		de_sanct;	/* S or blank */
+	int		de_len;
+	unsigned	de_flags;
+	int		de_recsz;	/* -1 if not a file */
+	char		*de_device;	/* NULL if not a device */
+	char		de_devbuf[5];
+} direntry_t;
+
+
+static void decode_direntry(tsb_ctx_t *tsb, unsigned char *dbuf,
+			    direntry_t *de)
 {
-	int i, len;
+	int i;
 	unsigned flags;
-	char name[6], dev[5];
-	char type, mode, sanct;
 
+	de->de_uid = BE16(dbuf);
 	for (i = 0; i < 6; i++)
-		name[i] = dbuf[i+2] & 0x7f;
+		de->de_name[i] = dbuf[i+2] & 0x7f;
+	for (i = 6; i > 0 && de->de_name[i-1] == ' '; i--)
+		;
+	de->de_name[i] = '\0';
+
 	flags = BE16(dbuf+14);		/* pre-Access: drum addr */
 		    /* Access: 0=unrestricted 1=protected 2=locked 3=private */
 		    /*   bits:       11=fcp 12=mwa 13=pfa 14=output 15=input */
-	len = BE16(dbuf+22);
+	de->de_flags = flags;
+	de->de_len = BE16(dbuf+22);
+	de->de_recsz = (dbuf[4] & 0x80) ? BE16(dbuf+8) : -1;
 
-	type = mode = sanct = ' ';
+	de->de_type = de->de_mode = de->de_sanct = ' ';
 	if (dbuf[4] & 0x80) {
-		type = 'F';		/* TSB file */
+		de->de_type = 'F';	/* TSB file */
 	} else if (dbuf[6] & 0x80)
-		type = 'C';		/* CSAVEd */
-	if (type != 'F')
-		len = -(int16_t) len;
+		de->de_type = 'C';	/* CSAVEd */
+	if (de->de_type != 'F')
+		de->de_len = -(int16_t) de->de_len;
 
-	if (is_access > 0) {	/* Access: */
+	if (tsb->ts_access > 0) {	/* Access: */
 		if (dbuf[2] & 0x80)
-			type = 'A';	/* ASCII file */
-		if (type == 'F' && (flags & 0x1000))
-			type = 'M';	/* MWA */
+			de->de_type = 'A';	/* ASCII file */
+		if (de->de_type == 'F' && (flags & 0x1000))
+			de->de_type = 'M';	/* MWA */
 		if (flags & 0x1)
-			mode = 'U';	/* unrestricted */
+			de->de_mode = 'U';	/* unrestricted */
 		else if (flags & 0x2)
-			mode = 'P';	/* protected */
+			de->de_mode = 'P';	/* protected */
 		else if (flags & 0x4)
-			mode = 'L';	/* locked */
+			de->de_mode = 'L';	/* locked */
 	} else {		/* pre-Access: */
 		if (dbuf[2] & 0x80)
-			mode = 'P';	/* protected */
+			de->de_mode = 'P';	/* protected */
 		if (flags)
-			sanct = 'S';	/* sanctified */
+			de->de_sanct = 'S';	/* sanctified */
 	}
 
-	printf("%.6s %c%c%c", name, type, mode, sanct);
-	if (verbose || type != 'A' || len)
-		printf("%4d", len);
+	de->de_device = NULL;
+	if (de->de_type == 'A' && BE16(dbuf+16) == 0xffff)
+		de->de_device = device_str(de->de_devbuf, dbuf);
+}
+
+
+void print_direntry(tsb_ctx_t *tsb, unsigned char *dbuf)
+{
+	char dev[5];
+	direntry_t de;
+	FILE *fp = tsb->ts_out;
+
+	decode_direntry(tsb, dbuf, &de);
+
+	fprintf(fp, "%-6s %c%c%c", de.de_name, de.de_type, de.de_mode,
+		de.de_sanct);
+	if (tsb->ts_verbose || de.de_type != 'A' || de.de_len)
+		fprintf(fp, "%4d", de.de_len);
 	else
-		printf("%4s", device_str(dev, dbuf));
+		fprintf(fp, "%4s", device_str(dev, dbuf));
 
-	if (verbose) {
+	if (tsb->ts_verbose) {
 		unsigned adate = BE16(dbuf+10);
 		int yr = adate >> 9;
 		int jday = adate & 0x1ff;
 
-		printf("  ");
-		print_date(yr, jday);
+		fprintf(fp, "  ");
+		print_date(fp, yr, jday);
 
-		if (verbose > 1) {
+		if (tsb->ts_verbose > 1) {
 			unsigned mjday = BE16(dbuf+12) / 24;
 			struct tm tm;
 
 			if (jdate_to_tm(mjday <= jday ? yr
 						      : yr-1, mjday, &tm) < 0)
-				printf(" ??-???");
+				fprintf(fp, " ??-???");
 			else
-				printf(" %2d-%.3s", tm.tm_mday,
+				fprintf(fp, " %2d-%.3s", tm.tm_mday,
 						    mos + 3*tm.tm_mon);
-			printf(" flags=0x%04x", flags);
+			fprintf(fp, " flags=0x%04x", de.de_flags);
 		}
 
-		if (dbuf[4] & 0x80)
-			printf(" recsz=%d", BE16(dbuf+8));
-		if (type == 'A' && BE16(dbuf+16) == 0xffff)
-			printf(" device=%s", device_str(dev, dbuf));
+		if (de.de_recsz >= 0)
+			fprintf(fp, " recsz=%d", de.de_recsz);
+		if (de.de_device)
+			fprintf(fp, " device=%s", de.de_device);
 
-		if (is_access > 0) {
-			if (flags & 0x800)
-				printf(" FCP");
-			if (flags & 0x2000)
-				printf(" PFA");
+		if (tsb->ts_access > 0) {
+			if (de.de_flags & 0x800)
+				fprintf(fp, " FCP");
+			if (de.de_flags & 0x2000)
+				fprintf(fp, " PFA");
 		}
 	}
 }
 
 
-int do_topt(TAPE *tap)
+/*
+ * -F json, -F csv, -S: one record per directory entry, for other programs.
+ */
+
+/* reel label, as it applies to the entries that follow it */
+typedef struct {
+	int	lb_reel;		/* 0 if no label seen yet */
+	int	lb_hib;
+	int	lb_yr, lb_jday;
+} label_t;
+
+
+/* ISO 8601 date, or NULL if invalid */
+static char *iso_date(char *buf, size_t bufsz, int yr, int jday)
+{
+	struct tm tm;
+
+	if (jdate_to_tm(yr, jday, &tm) < 0)
+		return NULL;
+	snprintf(buf, bufsz, "%04d-%02d-%02d", tm.tm_year+1900, tm.tm_mon+1,
+		 tm.tm_mday);
+	return buf;
+}
+
+
+/* offset is of the block holding the entry, -1 if unknown */
+static void print_record(tsb_ctx_t *tsb, TAPE *tap, off_t off,
+			 label_t *lb, unsigned char *dbuf)
+{
+	char offs[24], reel[12], date[12], uid[8], type[2], mode[2];
+	char sanct[2], len[12], recsz[12], adate[12], flags[12];
+	char *vals[CF_NFIELDS];
+	unsigned ad = BE16(dbuf+10);
+	direntry_t de;
+
+	decode_direntry(tsb, dbuf, &de);
+
+	snprintf(offs, sizeof offs, "%lld", (long long) off);
+	snprintf(reel, sizeof reel, "%d", lb->lb_reel);
+	snprintf(uid, sizeof uid, "%c%03d", '@' + (de.de_uid >> 10),
+		 de.de_uid & 0x3ff);
+	snprintf(type, sizeof type, "%.*s", de.de_type != ' ', &de.de_type);
+	snprintf(mode, sizeof mode, "%.*s", de.de_mode != ' ', &de.de_mode);
+	snprintf(sanct, sizeof sanct, "%d", de.de_sanct == 'S');
+	snprintf(len, sizeof len, "%d", de.de_len);
+	snprintf(recsz, sizeof recsz, "%d", de.de_recsz);
+	snprintf(flags, sizeof flags, "%u", de.de_flags);
+
+	vals[CF_TAPE] = tap->tp_path;
+	vals[CF_OFFSET] = off >= 0 ? offs : NULL;
+	vals[CF_REEL] = lb->lb_reel ? reel : NULL;
+	vals[CF_KIND] = !lb->lb_reel ? NULL
+				     : lb->lb_hib ? "hibernate" : "dump";
+	vals[CF_DATE] = lb->lb_reel ? iso_date(date, sizeof date,
+					       lb->lb_yr, lb->lb_jday)
+				    : NULL;
+	vals[CF_UID] = uid;
+	vals[CF_NAME] = de.de_name;
+	vals[CF_TYPE] = type;
+	vals[CF_MODE] = mode;
+	vals[CF_SANCT] = sanct;
+	vals[CF_LENGTH] = len;
+	vals[CF_RECSZ] = de.de_recsz >= 0 ? recsz : NULL;
+	vals[CF_ACCESSED] = iso_date(adate, sizeof adate, ad >> 9,
+				     ad & 0x1ff);
+	vals[CF_DEVICE] = de.de_device;
+	vals[CF_FLAGS] = flags;
+
+	cat_print(tsb, vals);
+}
+
+
+int do_topt(tsb_ctx_t *tsb, TAPE *tap)
 {
 	unsigned char *tbuf;
 	ssize_t nread;
@@ -349,9 +969,15 @@ int do_topt(TAPE *tap)
 	int is_hib = 0;
 	int prev_uid = -1;
 	int ec = 0;
+	int text = tsb->ts_format == FMT_TEXT;
+	label_t label;
+	FILE *fp = tsb->ts_out;
+
+	memset(&label, 0, sizeof(label_t));
 
 	while (1) {
 		int off = 0;
+		off_t boff = tap_tell(tap);
 
 		nread = tap_readblock(tap, (char **) &tbuf);
 		if (nread < 0) {
@@ -360,13 +986,14 @@ int do_topt(TAPE *tap)
 			break;
 		}
 		if (nread == 0) {
-			printf("  --mark--\n");
+			if (text)
+				fprintf(fp, "  --mark--\n");
 			continue;
 		}
 
 		/* process TSB labels */
-		tfile_ctx_init(&tfile, tap, tbuf, nread, 0);
-		if (is_tsb_label(tbuf, nread)) {
+		tfile_ctx_init(&tfile, tsb, tap, tbuf, nread, 0);
+		if (is_tsb_label(tsb, tbuf, nread)) {
 			unsigned char dbuf[20];
 
 			/* save label */
@@ -380,10 +1007,18 @@ int do_topt(TAPE *tap)
 			}
 
 			/* print label */
-			printf("\nTSB %s reel %-2d  ",
-				is_hib ? "Hibernate" : "Dump", BE16(dbuf+8));
-		        print_date(BE16(dbuf+10), BE16(dbuf+12) / 24);
-			printf("  oslvl %d-%d\n", BE16(dbuf+16), BE16(dbuf+18));
+			label.lb_reel = BE16(dbuf+8);
+			label.lb_hib = is_hib;
+			label.lb_yr = BE16(dbuf+10);
+			label.lb_jday = BE16(dbuf+12) / 24;
+			if (text) {
+				fprintf(fp, "\nTSB %s reel %-2d  ",
+					is_hib ? "Hibernate" : "Dump",
+					label.lb_reel);
+				print_date(fp, label.lb_yr, label.lb_jday);
+				fprintf(fp, "  oslvl %d-%d\n",
+					BE16(dbuf+16), BE16(dbuf+18));
+			}
 
 			if (nread < 0) {
 				if (nread == -2)
@@ -396,24 +1031,27 @@ int do_topt(TAPE *tap)
 			goto next;
 		}
 
-		if (is_access <= 0)	/* skip pre-Access header */
+		if (tsb->ts_access <= 0)	/* skip pre-Access header */
 			off = 2;
 
-		if (nread >= 24 + off) {
+		if (nread >= 24 + off && !text) {
+			print_record(tsb, tap, boff, &label, tbuf + off);
+
+		} else if (nread >= 24 + off) {
 			int uid = BE16(tbuf + off);
 
 			if (uid != prev_uid) {
-				if (!verbose)
-					printf("\n");
-				printf("\n%c%03d:\n",
+				if (!tsb->ts_verbose)
+					fprintf(fp, "\n");
+				fprintf(fp, "\n%c%03d:\n",
 				       '@' + (uid >> 10), uid & 0x3ff);
 				prev_uid = uid;
 			}
-			print_direntry(tbuf + off);
-			printf("%s", verbose ? "\n" : "\t");
+			print_direntry(tsb, tbuf + off);
+			fprintf(fp, "%s", tsb->ts_verbose ? "\n" : "\t");
 
-		} else {
-			printf("  --short block: %ld byte%s--\n", nread,
+		} else if (text) {
+			fprintf(fp, "  --short block: %ld byte%s--\n", nread,
 			       nread == 1 ? "" : "s");
 		}
 
@@ -422,8 +1060,8 @@ next:
 		tfile_ctx_fini(&tfile);
 	}
 
-	if (!verbose)
-		printf("\n");
+	if (text && !tsb->ts_verbose)
+		fprintf(fp, "\n");
 	return ec;
 }
 
@@ -435,199 +1073,183 @@ next:
 
 void print_number(SINK *snp, unsigned char *buf)
 {
-	char sbuf[32], *sp = sbuf;
-	int e;
-	double val;
-	int mant, expt;
+	char sbuf[HPF_BUFSZ];
+
+	sink_write(snp, sbuf, hpf_format(buf, sbuf));
+}
 
-	mant = (buf[0] << 16) | (buf[1] << 8) | buf[2];
-	if (buf[0] & 0x80)	/* negative: sign-extend */
-		mant |= 0xff000000;
-	val = mant / (1.0 * (1 << 23));
 
-	expt = buf[3] >> 1;
-	if (buf[3] & 1)		/* negative exponent */
-		val /= pow(2, 128-expt);
+static int xopt_file(tfile_ctx_t *tfile, unsigned char *dbuf, char *nbuf,
+		     char *name, char *fn, char *pattern)
+{
+	char *err = NULL;
+	char oname[OUT_NAMESZ];
+
+	oname[0] = '\0';
+
+	/* -H frames give id and name as on tape */
+	if (tfile->tf_tsb->ts_sout && tfile->tf_tsb->ts_arch) {
+		strcat(nbuf, "/");
+		strcat(nbuf, name);
+		fn = nbuf;
+
+	/* place in subdir if user didn't specify id */
+	} else if (!strchr(pattern, '/')) {
+		strcat(nbuf, "/");
+		strcat(nbuf, fn);
+		fn = nbuf;
+	}
+
+	/* extract file */
+	if (tfile->tf_tsb->ts_access > 0 && (dbuf[2] & 0x80))
+		err = extract_ascii_file(tfile, fn, oname, dbuf);
+	else if (dbuf[4] & 0x80)
+		err = extract_basic_file(tfile, fn, oname, dbuf);
 	else
-		val *= pow(2, expt);
-
-	/* Convert to string, advance past leading '-' */
-	sprintf(sp, "%G", val);
-	if (*sp == '-')
-		sink_putc(*sp++, snp);
-
-	/* Special case "0.*" */
-	if (sp[0] == '0' && sp[1] == '.') {
-		sp++;			/* drop initial '0' before decimal */
-		if (strlen(sp+1) > 6) {	/* too many digits? */
-			/* print as 'E' format */
-			e = 1;
-			for (sp++; *sp == '0'; sp++)
-				e++;
-			sink_putc(*sp++, snp);
-			sink_printf(snp, ".%sE-%02d", sp, e);
-			*sp = '\0';	/* nothing else to print */
+		err = extract_program(tfile, fn, oname, dbuf);
 
-		}
+	/* get access time from directory entry */
+	if (oname[0]) {
+		struct tm tm;
+		unsigned adate = BE16(dbuf+10);
 
-	/* Special case "?E*" */
-	} else if (sp[1] == 'E') {
-		/* small negative exp: print as decimal, not 'E' format */
-		if (sp[2] == '-' && sp[3] == '0' && sp[4] < '7') {
-			sink_putc('.', snp);
-			for (e = sp[4]-'0'; e > 1; e--)
-				sink_putc('0', snp);
-			sp[1] = '\0';	/* delete "E*" */
-
-		/* otherwise, insert '.' between initial digit and 'E' */
-		} else {
-			sink_putc(*sp++, snp);
-			sink_putc('.', snp);
-		}
+		memset(&tm, 0, sizeof(tm));
+		if (jdate_to_tm(adate >> 9, adate & 0x1ff, &tm) >= 0)
+			set_mtime(tfile->tf_tsb, oname, &tm);
 	}
 
-	/* Print remaining part of conversion to string */
-	sink_printf(snp, "%s", sp);
-
-	/* Append '.' to some large integers */
-	if (!strchr(sp, '.')) {
-		val = fabs(val);
-		if (val > 32767 && val < 1000000)
-			sink_putc('.', snp);
+	if (err) {
+		if (err[0])
+			fprintf(out_msgf(tfile->tf_tsb), "%s: %s\n", fn, err);
+		return 2;
 	}
+	return 0;
 }
 
 
-int do_xopt(TAPE *tap, int argc, char **argv)
+int do_xopt(tsb_ctx_t *tsb, TAPE *tap, tap_index_t *idx, int argc,
+	    char **argv)
 {
-	int i, ec = 0;
-	ssize_t nread;
-	unsigned char *tbuf;
-	char *found;
-
-	found = alloca(argc);
-	if (!found) {
-		fprintf(stderr, "too many file names\n");
-		return 3;
-	}
-	memset(found, 0, argc);
-
-	while ((nread = tap_readblock(tap, (char **)&tbuf)) >= 0) {
-		unsigned char dbuf[24];
-		char *err, *fn;
-		char nbuf[12], name[7], oname[28];
-		unsigned uid;
-		int nbytes;
-		tfile_ctx_t tfile;
-
-		/* skip tapemarks */
-		if (nread == 0)
-			continue;
-
-		/* skip TSB labels */
-		if (is_tsb_label(tbuf, nread)) {
-			tfile_ctx_init(&tfile, tap, tbuf, nread, 0);
-			goto next;
-		}
+	return each_file(tsb, tap, idx, argc, argv, xopt_file, njobs);
+}
 
-		tfile_ctx_init(&tfile, tap, tbuf, nread, is_access > 0 ? 0 : 2);
-		nbytes = tfile_getbytes(&tfile, dbuf, 24);
-		if (nbytes < 24)	/* skip short block */
-			goto next;
 
-		/* get id and name */
-		uid = BE16(dbuf);
-		sprintf(nbuf, "%c%03d", '@' + (uid >> 10), uid & 0x3ff);
-		for (i = 0; i < 6; i++) {
-			name[i] = dbuf[i+2] & 0x7f;
-			if (name[i] == ' ')
-				break;
-		}
-		name[i] = '\0';
+/*
+ * Main program.
+ */
 
-		/* check for match */
-		for (i = 0; i < argc; i++)
-			if (fn = name_match(argv[i], nbuf, name))
-				break;
-		if (i == argc) /* no match */
-			goto next;
-		found[i] = 1;
-		err = NULL;
-		oname[0] = '\0';
-
-		/* place in subdir if user didn't specify id */
-		if (!strchr(argv[i], '/')) {
-			strcat(nbuf, "/");
-			strcat(nbuf, fn);
-			fn = nbuf;
-		}
+/* add patterns from file, one per line, to *np, *pp */
+/* returns -1 if error */
+static int read_patterns(char *path, int *np, char ***pp)
+{
+	FILE *fp;
+	char *line = NULL, **pats;
+	size_t linesz = 0;
+	ssize_t len;
+	int n = *np, max = n + 64;
+
+	if (strcmp(path, "-") == 0)
+		fp = stdin;
+	else if (!(fp = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
 
-		/* extract file */
-		if (is_access > 0 && (dbuf[2] & 0x80))
-			err = extract_ascii_file(&tfile, fn, oname, dbuf);
-		else if (dbuf[4] & 0x80)
-			err = extract_basic_file(&tfile, fn, oname, dbuf);
-		else
-			err = extract_program(&tfile, fn, oname, dbuf);
+	pats = malloc(max * sizeof(char *));
+	if (!pats)
+		goto nomem;
+	memcpy(pats, *pp, n * sizeof(char *));
 
-		/* get access time from directory entry */
-		if (oname[0]) {
-			struct tm tm;
-			unsigned adate = BE16(dbuf+10);
+	while ((len = getline(&line, &linesz, fp)) >= 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
 
-			if (jdate_to_tm(adate >> 9, adate & 0x1ff, &tm) >= 0)
-				set_mtime(oname, &tm);
-		}
+		if (n == max) {
+			char **npats;
 
-		if (err) {
-			ec = 2;
-			if (err[0])
-				printf("%s: %s\n", fn, err);
+			max *= 2;
+			npats = realloc(pats, max * sizeof(char *));
+			if (!npats)
+				goto nomem;
+			pats = npats;
 		}
-
-next:
-		tfile_skipf(&tfile);
-		tfile_ctx_fini(&tfile);
+		if (!(pats[n] = strdup(line)))
+			goto nomem;
+		n++;
 	}
 
-	if (nread == -2)
-		ec = 2;
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	*np = n;
+	*pp = pats;
+	return 0;
 
-	for (i = 0; i < argc; i++)
-		if (!found[i]) {
-			fprintf(stderr, "%s not found\n", argv[i]);
-			ec = 3;
-		}
-	return ec;
+nomem:
+	fprintf(stderr, "%s: out of memory\n", path);
+	free(line);
+	free(pats);
+	if (fp != stdin)
+		fclose(fp);
+	return -1;
 }
 
 
-/*
- * Main program.
- */
-
 char *prog;
 
 
 void usage(int ec)
 {
-	fprintf(stderr, "Usage:  %s [-Av]   -f path.tap {-r | -t}\n", prog);
-	fprintf(stderr, "        %s [-AeOv] -f path.tap {-d | -x} files...\n",
+	fprintf(stderr, "Usage:  %s [-Av]    -f path.tap {-r | -t}\n", prog);
+	fprintf(stderr, "        %s [-Av]    [-j n] -f path.tap -r\n", prog);
+	fprintf(stderr, "        %s [-A]     -F {json | csv} -f path.tap -t\n",
+			prog);
+	fprintf(stderr, "        %s [-AeiOv] [-T list] [-X excl]... -f path.tap {-d | -x} files...\n",
+			prog);
+	fprintf(stderr, "        %s [-AeiOv] [-H] [-j n] -f path.tap -x files...\n",
+			prog);
+	fprintf(stderr, "        %s [-Aeiv]  [-j n] -o archive.tar -f path.tap -x files...\n",
 			prog);
-	fprintf(stderr, "        %s [-Aev]  -f path.tap {-a | -c} out.tap\n",
+	fprintf(stderr, "        %s [-Aev]   -f path.tap {-a | -c} out.tap\n",
 			prog);
-	fprintf(stderr, " -f   file in SIMH tape format (required)\n");
+	fprintf(stderr, "        %s [-Av] [-F fmt] [-j n] -B list -t\n",
+			prog);
+	fprintf(stderr, "        %s [-Aeiv]  [-I state] [-j n] -f path.tap -x files...\n",
+			prog);
+	fprintf(stderr, "        %s [-AeiOv] [-C dir | -I state] [-j n] -B list -x files...\n",
+			prog);
+	fprintf(stderr, "        %s [-A]     [-j n] -S store {-f path.tap | -B list} -t\n",
+			prog);
+	fprintf(stderr, "        %s [-F fmt] -S store -q [files...] [filter=value...]\n",
+			prog);
+	fprintf(stderr, " -f   file in SIMH tape format\n");
+	fprintf(stderr, " -B   file listing tapes, one per line (- for stdin)\n");
+	fprintf(stderr, " -C d extract into content-addressed store d, with a manifest per tape\n");
 	fprintf(stderr, "operations:\n");
 	fprintf(stderr, " -a   convert tape to Access from 2000F\n");
 	fprintf(stderr, " -c   convert tape to 2000F from Access\n");
 	fprintf(stderr, " -d   show tokens of TSB program \n");
+	fprintf(stderr, " -q   query catalog store; filters are tape=glob, type=FCAMB,\n");
+	fprintf(stderr, "      from=date, to=date (YYYY[-MM[-DD]]), minlen=n, maxlen=n\n");
 	fprintf(stderr, " -r   show raw tape block structure\n");
 	fprintf(stderr, " -t   catalog the tape\n");
 	fprintf(stderr, " -x   extract files from tape\n");
 	fprintf(stderr, "modifiers:\n");
 	fprintf(stderr, " -A   tape is from 2000 Access (default no, or from OS level if found on tape)\n");
 	fprintf(stderr, " -e   continue on error (corrupted file / unsupported construct)\n");
+	fprintf(stderr, " -F f catalog as JSON Lines (json) or CSV (csv), one record per file\n");
+	fprintf(stderr, " -H   with -O, precede each file with a header line giving its size\n");
+	fprintf(stderr, " -i   use block index path.tap.idx, creating it if needed\n");
+	fprintf(stderr, " -I s skip files unchanged since extracted before, as recorded in state file s\n");
+	fprintf(stderr, " -j n extract up to n files at once (-x), dump with n threads (-r),\n");
+	fprintf(stderr, "      or process up to n tapes at once (-B)\n");
 	fprintf(stderr, " -O   extract to stdout (default write to file)\n");
+	fprintf(stderr, " -o a extract into tar archive a (- for stdout)\n");
+	fprintf(stderr, " -T l read more files from list, one per line (- for stdin)\n");
+	fprintf(stderr, " -X p skip files matching p, even if they match files\n");
+	fprintf(stderr, " -S s catalog store: -t adds tapes to it, -q queries it\n");
 	fprintf(stderr, " -v   verbose output\n");
 	fprintf(stderr, " -vv  more verbose output\n");
 	exit(ec);
@@ -640,27 +1262,396 @@ void usage(int ec)
 #define OP_T	8
 #define OP_D	16
 #define OP_X	32
+#define OP_Q	64
+
+/* base name of tape image path minus ".tap", or with ".out" if none */
+static char *tape_stem(char *path)
+{
+	char *base, *rv;
+	int len;
+
+	base = strrchr(path, '/');
+	base = base ? base+1 : path;
+	len = strlen(base);
+
+	rv = malloc(len + 5);
+	if (!rv)
+		return NULL;
+	if (len > 4 && strcmp(base + len - 4, ".tap") == 0)
+		sprintf(rv, "%.*s", len - 4, base);
+	else
+		sprintf(rv, "%s.out", base);
+	return rv;
+}
+
+
+/*
+ * -C manifest path for the tape at rpath (a real path): its stem, and a
+ * hash of rpath to tell apart tapes of the same base name. The same
+ * tape gets the same manifest on every run.
+ */
+/* returns NULL if out of memory */
+static char *tape_manifest(tsb_ctx_t *tsb, char *rpath)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+	char *stem, *manifest, *s;
+
+	for (s = rpath; *s; s++) {
+		h ^= (unsigned char) *s;
+		h *= 16777619u;
+	}
+
+	if (!(stem = tape_stem(rpath)))
+		return NULL;
+	manifest = malloc(strlen(tsb->ts_cas) + strlen(stem) + 20);
+	if (manifest)
+		sprintf(manifest, "%s/%s-%08x.manifest", tsb->ts_cas, stem, h);
+	free(stem);
+	return manifest;
+}
+
+
+/* returns exit status */
+static int do_tape(tsb_ctx_t *tsb, char *ifile, char *ofile, unsigned op,
+		   int use_idx, int argc, char **argv)
+{
+	int ec;
+	char *rpath = NULL, *manifest = NULL;
+	TAPE *tap, *ot = NULL;
+	tap_index_t *idx = NULL;
+
+	/* stored records, -I state and -C manifests identify the image */
+	if (tsb->ts_format == FMT_STORE || tsb->ts_state || tsb->ts_cas) {
+		if (!(rpath = realpath(ifile, NULL))) {
+			perror(ifile);
+			return 1;
+		}
+		if (tsb->ts_format == FMT_STORE)
+			ifile = rpath;
+		tsb->ts_tapeid = rpath;
+	}
+
+	if (!(tap = tap_open(ifile, 0))) {
+		perror(ifile);
+		free(rpath);
+		return 1;
+	}
+
+	if (ofile) {
+		if (!(ot = tap_open(ofile, 1))) {
+			perror(ofile);
+			tap_close(tap);
+			return 1;
+		}
+	}
+
+	if (use_idx)
+		idx = idx_open(tsb, tap);
+
+	if (tsb->ts_state && !tap_is_mapped(tap))
+		fprintf(stderr, "%s: not mapped, extracting all files\n",
+			ifile);
+
+	/* -C: this tape's manifest goes in the store */
+	if (tsb->ts_cas) {
+		manifest = tape_manifest(tsb, rpath);
+		if (!manifest || out_arch_open(tsb, manifest, ARCH_STORE,
+					       tsb->ts_cas) < 0) {
+			if (!manifest)
+				fprintf(stderr, "Out of memory\n");
+			free(manifest);
+			manifest = NULL;
+			op = 0;
+			ec = 1;
+		}
+	}
+
+	tsb->ts_pool = prog_pool_init();
+
+	switch (op) {
+	    case OP_A:  ec = do_aopt(tsb, tap, ot); break;
+	    case OP_C:  ec = do_copt(tsb, tap, ot); break;
+	    case OP_D:  ec = do_dopt(tsb, tap, idx, argc, argv); break;
+	    case OP_R:  ec = do_ropt(tsb, tap); break;
+	    case OP_T:  ec = do_topt(tsb, tap); break;
+	    case OP_X:  ec = do_xopt(tsb, tap, idx, argc, argv); break;
+	}
+
+	if (manifest) {
+		if (out_arch_close(tsb) < 0)
+			ec = MAX(ec, 1);
+		free(manifest);
+	}
+
+	if (tsb->ts_pool) {
+		prog_pool_fini(tsb->ts_pool);
+		tsb->ts_pool = NULL;
+	}
+	out_fini(tsb);
+	free(tsb->ts_outname);
+	tsb->ts_outname = NULL;
+	tsb->ts_tapeid = NULL;
+	if (idx)
+		idx_close(idx);
+	if (ot)
+		tap_close(ot);
+
+	tap_close(tap);
+	free(rpath);
+
+	return ec;
+}
+
+
+/*
+ * -B: run -t or -x on each tape image named in a list, several at once.
+ * Each tape's output is collected and written out in list order.
+ */
+
+typedef struct {
+	char		*bj_path;
+	tsb_ctx_t	bj_tsb;		/* private copy; ts_out is a buffer */
+	char		*bj_out;
+	size_t		bj_outlen;
+	unsigned	bj_op;
+	int		bj_use_idx;
+	int		bj_argc;
+	char		**bj_argv;
+	int		bj_ec;
+} batch_job_t;
+
+
+static void run_batch_job(void *arg)
+{
+	batch_job_t *job = arg;
+
+	job->bj_ec = do_tape(&job->bj_tsb, job->bj_path, NULL, job->bj_op,
+			     job->bj_use_idx, job->bj_argc, job->bj_argv);
+	fclose(job->bj_tsb.ts_out);
+}
+
+
+/* returns exit status of tape */
+static int commit_batch_job(tsb_ctx_t *tsb, batch_job_t *job, int first)
+{
+	int ec = job->bj_ec;
+	FILE *fp = tsb->ts_out;
+
+	if (job->bj_tsb.ts_format == FMT_TEXT) {
+		if (!first)
+			putc('\n', fp);
+		fprintf(fp, "%s:\n", job->bj_path);
+	}
+	fwrite(job->bj_out, 1, job->bj_outlen, fp);
+	fflush(fp);
+
+	free(job->bj_out);
+	free(job->bj_tsb.ts_outdir);
+	free(job->bj_path);
+	free(job);
+	return ec;
+}
+
+
+/*
+ * Output directory for a tape in a -B list: its stem, with a ".2", ".3",
+ * ... suffix if an earlier tape in the list already has that directory,
+ * so tapes of the same base name in different directories stay apart.
+ * dirs holds the *ndirs names used so far.
+ */
+/* returns NULL if out of memory */
+static char *batch_outdir(char *path, char ***dirsp, int *ndirsp)
+{
+	char *stem, *dir, **dirs;
+	int i, n = 1;
+
+	if (!(stem = tape_stem(path)))
+		return NULL;
+	if (!(dir = malloc(strlen(stem) + 12))) {
+		free(stem);
+		return NULL;
+	}
+	strcpy(dir, stem);
+	for (i = 0; i < *ndirsp; i++) {
+		if (strcmp((*dirsp)[i], dir) == 0) {
+			sprintf(dir, "%s.%d", stem, ++n);
+			i = -1;		/* check new name from the start */
+		}
+	}
+	free(stem);
+
+	if (!(dirs = realloc(*dirsp, (*ndirsp + 1) * sizeof(char *)))) {
+		free(dir);
+		return NULL;
+	}
+	*dirsp = dirs;
+	if (!(dirs[*ndirsp] = strdup(dir))) {
+		free(dir);
+		return NULL;
+	}
+	(*ndirsp)++;
+	return dir;
+}
+
+
+/* returns largest exit status of any tape */
+static int do_batch(tsb_ctx_t *tsb, char *blist, unsigned op, int use_idx,
+		    int argc, char **argv)
+{
+	FILE *lfp;
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t len;
+	int ec = 0, rv, ntapes = 0, nfail = 0;
+	char **dirs = NULL;
+	int i, ndirs = 0;
+	batch_job_t *job;
+	workq_t *wq;
+
+	if (strcmp(blist, "-") == 0)
+		lfp = stdin;
+	else if (!(lfp = fopen(blist, "r"))) {
+		perror(blist);
+		return 1;
+	}
+
+	if (!(wq = workq_init(njobs))) {
+		fprintf(stderr, "-B: unable to start threads\n");
+		if (lfp != stdin)
+			fclose(lfp);
+		return 1;
+	}
+
+	/* tapes run in parallel; files within each tape do not */
+	njobs = 1;
+
+	while ((len = getline(&line, &linesz, lfp)) >= 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		job = malloc(sizeof(batch_job_t));
+		if (!job) {
+			fprintf(stderr, "%s: out of memory\n", line);
+			ec = MAX(ec, 1);
+			break;
+		}
+		memset(job, 0, sizeof(batch_job_t));
+		job->bj_path = strdup(line);
+		job->bj_tsb = *tsb;
+		job->bj_op = op;
+		job->bj_use_idx = use_idx;
+		job->bj_argc = argc;
+		job->bj_argv = argv;
+		job->bj_tsb.ts_out = open_memstream(&job->bj_out,
+						    &job->bj_outlen);
+		if (op == OP_X && !tsb->ts_sout)
+			job->bj_tsb.ts_outdir = batch_outdir(line, &dirs,
+							     &ndirs);
+		if (!job->bj_path || !job->bj_tsb.ts_out ||
+		    (op == OP_X && !tsb->ts_sout && !job->bj_tsb.ts_outdir) ||
+		    workq_submit(wq, run_batch_job, job) < 0) {
+			fprintf(stderr, "%s: out of memory\n", line);
+			if (job->bj_tsb.ts_out)
+				fclose(job->bj_tsb.ts_out);
+			free(job->bj_out);
+			free(job->bj_tsb.ts_outdir);
+			free(job->bj_path);
+			free(job);
+			ec = MAX(ec, 1);
+			break;
+		}
+
+		/* bound buffered output */
+		while (workq_pending(wq) >= 2 * wq->wq_nthreads) {
+			rv = commit_batch_job(tsb, workq_next(wq),
+					      ntapes++ == 0);
+			if (rv)
+				nfail++;
+			ec = MAX(ec, rv);
+		}
+	}
+
+	while (job = workq_next(wq)) {
+		rv = commit_batch_job(tsb, job, ntapes++ == 0);
+		if (rv)
+			nfail++;
+		ec = MAX(ec, rv);
+	}
+
+	workq_fini(wq);
+	for (i = 0; i < ndirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	free(line);
+	if (lfp != stdin)
+		fclose(lfp);
+
+	if (nfail)
+		fprintf(stderr, "%d of %d tapes had errors\n", nfail, ntapes);
+
+	return ec;
+}
+
 
 void main(int argc, char **argv)
 {
 	int c, ec, opname;
+	int use_idx = 0, frame = 0;
 	unsigned op = 0;
-	char *ifile = NULL, *ofile = NULL;
-	TAPE *tap, *ot = NULL;
+	char *ifile = NULL, *ofile = NULL, *blist = NULL, *store = NULL;
+	char *tlist = NULL, *recs = NULL, *tarfile = NULL, *state = NULL;
+	char **files;
+	int nfiles;
+	size_t nrecs = 0;
+	tsb_ctx_t tsb;
+
+	memset(&tsb, 0, sizeof(tsb_ctx_t));
+	tsb.ts_access = -1;
+	tsb.ts_out = stdout;
 
 	prog = strrchr(argv[0], '/');
 	prog = prog ? prog+1 : argv[0];
 
-	while ((c = getopt(argc, argv, ":Aa:c:Ddef:Ohrtvx")) != -1) {
+	while ((c = getopt(argc, argv, ":AB:C:a:c:DF:HI:def:hij:Oo:qS:rT:tvX:x")) != -1) {
 		switch (c) {
 		    case 'A':
-			is_access = 1;
+			tsb.ts_access = 1;
+			break;
+
+		    case 'B':
+			blist = optarg;
+			break;
+
+		    case 'C':
+			tsb.ts_cas = optarg;
 			break;
 
 		    case 'D':
 			debug++;
 			break;
 
+		    case 'F':
+			if (strcmp(optarg, "json") == 0)
+				tsb.ts_format = FMT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				tsb.ts_format = FMT_CSV;
+			else {
+				fprintf(stderr, "-F: unknown format %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+
+		    case 'H':
+			frame++;
+			break;
+
+		    case 'I':
+			state = optarg;
+			break;
+
 		    case 'a':
 			ofile = optarg;
 			op |= OP_A;
@@ -678,7 +1669,7 @@ void main(int argc, char **argv)
 			break;
 
 		    case 'e':
-			ignore_errs++;
+			tsb.ts_ignerr++;
 			break;
 
 		    case 'f':
@@ -689,8 +1680,33 @@ void main(int argc, char **argv)
 			usage(0);
 			break;
 
+		    case 'i':
+			use_idx++;
+			break;
+
+		    case 'j':
+			njobs = atoi(optarg);
+			if (njobs < 1) {
+				fprintf(stderr, "-j: invalid number %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+
 		    case 'O':
-			sout++;
+			tsb.ts_sout++;
+			break;
+
+		    case 'o':
+			tarfile = optarg;
+			break;
+
+		    case 'q':
+			op |= OP_Q;
+			break;
+
+		    case 'S':
+			store = optarg;
 			break;
 
 		    case 'r':
@@ -704,13 +1720,27 @@ void main(int argc, char **argv)
 			break;
 
 		    case 'v':
-			verbose++;
+			tsb.ts_verbose++;
 			break;
 
 		    case 'x':
 			op |= OP_X;
 			break;
 
+		    case 'T':
+			tlist = optarg;
+			break;
+
+		    case 'X':
+			tsb.ts_excl = realloc(tsb.ts_excl,
+					(tsb.ts_nexcl+1) * sizeof(char *));
+			if (!tsb.ts_excl) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			tsb.ts_excl[tsb.ts_nexcl++] = optarg;
+			break;
+
 		    case ':':
 			fprintf(stderr, "option -%c requires an operand\n",
 				optopt);
@@ -724,8 +1754,29 @@ void main(int argc, char **argv)
 		}
 	}
 
-	if (!ifile) {
-		fprintf(stderr, "-f must be specified\n");
+	nfiles = argc - optind;
+	files = argv + optind;
+	if (tlist) {
+		if (blist && strcmp(tlist, "-") == 0 &&
+		    strcmp(blist, "-") == 0) {
+			fprintf(stderr, "-B and -T can't both read stdin\n");
+			usage(1);
+		}
+		if (read_patterns(tlist, &nfiles, &files) < 0)
+			exit(1);
+	}
+
+	if (op == OP_Q) {
+		if (ifile || blist) {
+			fprintf(stderr, "-f and -B not allowed with -q\n");
+			usage(1);
+		}
+		if (!store) {
+			fprintf(stderr, "-q requires -S\n");
+			usage(1);
+		}
+	} else if (!ifile == !blist) {
+		fprintf(stderr, "exactly one of -f or -B must be specified\n");
 		usage(1);
 	}
 
@@ -734,56 +1785,131 @@ void main(int argc, char **argv)
 	    case OP_C:
 	    case OP_R:
 	    case OP_T:
-		if (optind < argc) {
+		if (nfiles || tlist || tsb.ts_nexcl) {
 			fprintf(stderr, "files not allowed with -%c\n", opname);
 			usage(1);
 		}
+		if (use_idx) {
+			fprintf(stderr, "-i not allowed with -%c\n", opname);
+			usage(1);
+		}
 		break;
 
 	    case OP_D:
 	    case OP_X:
-		if (optind >= argc) {
+		if (!nfiles) {
 			fprintf(stderr, "no files specified\n");
 			usage(1);
 		}
 		break;
 
+	    case OP_Q:
+		break;
+
 	    default:
 		fprintf(stderr,
-			"must specify exactly one of -a, -c, -d, -r, -t, or -x\n");
+			"must specify exactly one of -a, -c, -d, -q, -r, -t, or -x\n");
+		usage(1);
+	}
+
+	if (tsb.ts_format != FMT_TEXT && op != OP_T && op != OP_Q) {
+		fprintf(stderr, "-F only allowed with -t or -q\n");
+		usage(1);
+	}
+
+	if (store && op != OP_T && op != OP_Q) {
+		fprintf(stderr, "-S only allowed with -t or -q\n");
+		usage(1);
+	}
+
+	if (store && op == OP_T) {
+		if (tsb.ts_format != FMT_TEXT) {
+			fprintf(stderr, "-F not allowed with -S -t\n");
+			usage(1);
+		}
+		tsb.ts_format = FMT_STORE;
+	}
+
+	if (blist && op != OP_T && op != OP_X) {
+		fprintf(stderr, "-B only allowed with -t or -x\n");
+		usage(1);
+	}
+
+	if (njobs > 1 && op != OP_X && op != OP_R && !blist) {
+		fprintf(stderr, "-j only allowed with -x, -r or -B\n");
 		usage(1);
 	}
 
+	if (tarfile && (op != OP_X || blist || tsb.ts_sout)) {
+		fprintf(stderr, "-o only allowed with -f and -x, without -O\n");
+		usage(1);
+	}
+
+	if (tsb.ts_cas && (op != OP_X || tsb.ts_sout || tarfile)) {
+		fprintf(stderr, "-C only allowed with -x, without -O or -o\n");
+		usage(1);
+	}
+
+	if (state && (op != OP_X || tsb.ts_sout || tarfile || tsb.ts_cas)) {
+		fprintf(stderr, "-I only allowed with -x, without -O, -o or -C\n");
+		usage(1);
+	}
 
-	if (debug)
+	if (frame && (op != OP_X || blist || !tsb.ts_sout)) {
+		fprintf(stderr, "-H only allowed with -f, -x and -O\n");
+		usage(1);
+	}
+
+
+	/* keep debug output in order */
+	if (debug) {
 		setbuf(stdout, NULL);
+		njobs = 1;
+	}
 
-	if (!(tap = tap_open(ifile, 0))) {
-		perror(ifile);
+	if (op == OP_Q)
+		exit(cat_query(&tsb, store, nfiles, files));
+
+	/* collect records, then replace the tapes' records in the store */
+	if (tsb.ts_format == FMT_STORE &&
+	    !(tsb.ts_out = open_memstream(&recs, &nrecs))) {
+		perror(store);
 		exit(1);
 	}
 
-	if (ofile) {
-		if (!(ot = tap_open(ofile, 1))) {
-			perror(ofile);
-			tap_close(tap);
-			exit(1);
-		}
-	}
+	if (op == OP_T)
+		cat_print_header(&tsb);
 
-	switch (op) {
-	    case OP_A:  ec = do_aopt(tap, ot); break;
-	    case OP_C:  ec = do_copt(tap, ot); break;
-	    case OP_D:  ec = do_dopt(tap, argc-optind, argv+optind); break;
-	    case OP_R:  ec = do_ropt(tap); break;
-	    case OP_T:  ec = do_topt(tap); break;
-	    case OP_X:  ec = do_xopt(tap, argc-optind, argv+optind); break;
+	/* archive on stdout: messages go to stderr */
+	if (frame)
+		tarfile = "-";
+	if (tarfile) {
+		if (out_arch_open(&tsb, tarfile,
+				  frame ? ARCH_FRAME : ARCH_TAR, NULL) < 0)
+			exit(1);
+		if (strcmp(tarfile, "-") == 0)
+			tsb.ts_out = stderr;
 	}
 
-	if (ot)
-		tap_close(ot);
+	if (state && !(tsb.ts_state = xs_open(state)))
+		exit(1);
 
-	tap_close(tap);
+	if (blist)
+		ec = do_batch(&tsb, blist, op, use_idx, nfiles, files);
+	else
+		ec = do_tape(&tsb, ifile, ofile, op, use_idx, nfiles, files);
+
+	if (tsb.ts_arch && out_arch_close(&tsb) < 0)
+		ec = MAX(ec, 1);
+	if (tsb.ts_state && xs_close(tsb.ts_state) < 0)
+		ec = MAX(ec, 1);
+
+	if (tsb.ts_format == FMT_STORE) {
+		fclose(tsb.ts_out);
+		if (cat_store(store, recs, nrecs) < 0)
+			ec = MAX(ec, 1);
+		free(recs);
+	}
 
 	exit(ec);
 }
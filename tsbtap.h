@@ -23,17 +23,47 @@
 
 #define BE16(bp)	(((bp)[0] << 8) | (bp)[1])
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
 
 #define SYSLVL_2000F	3500	/* 2000F option 210/215 */
 #define FEATLVL_2000F	200
 #define SYSLVL_ACCESS	5000	/* Access release A */
 #define FEATLVL_ACCESS	1000
 
-extern int is_access;
-extern int ignore_errs;
+/*
+ * Decoder state for one tape. Each tape being read has its own, so that
+ * tapes (and the files on them) can be decoded concurrently.
+ */
+typedef struct tsb_ctx {
+	int	ts_access;	/* 2000 Access tape? -1 if not yet known */
+	int	ts_ignerr;	/* -e: continue on error */
+	int	ts_verbose;	/* -v */
+	int	ts_sout;	/* -O: extract to stdout */
+	FILE	*ts_out;	/* catalog, messages (normally stdout) */
+	char	*ts_outdir;	/* directory for extracted files, or NULL */
+	int	ts_format;	/* -F: catalog format, FMT_* */
+	int	ts_nexcl;	/* -X: patterns of files to skip */
+	char	**ts_excl;
+	struct prog_pool *ts_pool;	/* program buffers, or NULL */
+	struct out_names *ts_names;	/* output names issued, or NULL */
+	struct out_arch *ts_arch;	/* -o, -H, -C: archive or stream of files */
+	char	*ts_cas;	/* -C: content-addressed store, or NULL */
+	struct xstate *ts_state;	/* -I: files extracted before, or NULL */
+	char	*ts_tapeid;	/* -I: real path of tape image */
+	char	*ts_outname;	/* -I: file last made by out_open */
+} tsb_ctx_t;
+
+#define FMT_TEXT	0	/* for people */
+#define FMT_JSON	1	/* JSON Lines, one object per file */
+#define FMT_CSV		2	/* CSV, one row per file */
+#define FMT_STORE	3	/* catalog store lines (-S) */
+
+/*
+ * Only for tracing: set once from the command line, before any tape is
+ * read, and never changed.
+ */
 extern int debug;
-extern int verbose;
 
-extern int is_tsb_label(unsigned char *tbuf, int nbytes);
-extern void print_direntry(unsigned char *dbuf);
+extern int is_tsb_label(tsb_ctx_t *tsb, unsigned char *tbuf, int nbytes);
+extern void print_direntry(tsb_ctx_t *tsb, unsigned char *dbuf);
 extern void print_number(SINK *snp, unsigned char *buf);
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Pool of worker threads whose results are collected in submission order.
+ *
+ * Items run concurrently, in any order. workq_next() waits for the oldest
+ * submitted item and returns its argument, so the caller can write out
+ * results in the same order as a single-threaded run would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "workq.h"
+
+
+static void *worker(void *arg)
+{
+	workq_t *wq = arg;
+	wq_item_t *item;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	while (1) {
+		while (!wq->wq_todo && !wq->wq_stop)
+			pthread_cond_wait(&wq->wq_work, &wq->wq_lock);
+		if (!wq->wq_todo)
+			break;
+
+		item = wq->wq_todo;
+		wq->wq_todo = item->wi_next;
+		pthread_mutex_unlock(&wq->wq_lock);
+
+		item->wi_fn(item->wi_arg);
+
+		pthread_mutex_lock(&wq->wq_lock);
+		item->wi_done = 1;
+		pthread_cond_broadcast(&wq->wq_done);
+	}
+	pthread_mutex_unlock(&wq->wq_lock);
+
+	return NULL;
+}
+
+
+/* returns NULL if error */
+workq_t *workq_init(int nthreads)
+{
+	workq_t *wq;
+	int i;
+
+	wq = malloc(sizeof(workq_t));
+	if (!wq)
+		return NULL;
+	memset(wq, 0, sizeof(workq_t));
+
+	wq->wq_threads = malloc(nthreads * sizeof(pthread_t));
+	if (!wq->wq_threads) {
+		free(wq);
+		return NULL;
+	}
+	pthread_mutex_init(&wq->wq_lock, NULL);
+	pthread_cond_init(&wq->wq_work, NULL);
+	pthread_cond_init(&wq->wq_done, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&wq->wq_threads[i], NULL, worker, wq) != 0)
+			break;
+		wq->wq_nthreads++;
+	}
+	if (wq->wq_nthreads == 0) {
+		workq_fini(wq);
+		return NULL;
+	}
+
+	return wq;
+}
+
+
+/* returns -1 if out of memory */
+int workq_submit(workq_t *wq, workq_fn_t fn, void *arg)
+{
+	wq_item_t *item;
+
+	item = malloc(sizeof(wq_item_t));
+	if (!item)
+		return -1;
+	item->wi_fn = fn;
+	item->wi_arg = arg;
+	item->wi_done = 0;
+	item->wi_next = NULL;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	if (wq->wq_tail)
+		wq->wq_tail->wi_next = item;
+	else
+		wq->wq_head = item;
+	wq->wq_tail = item;
+	if (!wq->wq_todo)
+		wq->wq_todo = item;
+	wq->wq_npending++;
+	pthread_cond_signal(&wq->wq_work);
+	pthread_mutex_unlock(&wq->wq_lock);
+
+	return 0;
+}
+
+
+/* returns number of items submitted but not yet collected */
+int workq_pending(workq_t *wq)
+{
+	int rv;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	rv = wq->wq_npending;
+	pthread_mutex_unlock(&wq->wq_lock);
+	return rv;
+}
+
+
+/* wait for oldest item to finish */
+/* returns its arg, NULL if nothing pending */
+void *workq_next(workq_t *wq)
+{
+	wq_item_t *item;
+	void *rv;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	item = wq->wq_head;
+	if (!item) {
+		pthread_mutex_unlock(&wq->wq_lock);
+		return NULL;
+	}
+	while (!item->wi_done)
+		pthread_cond_wait(&wq->wq_done, &wq->wq_lock);
+	wq->wq_head = item->wi_next;
+	if (!wq->wq_head)
+		wq->wq_tail = NULL;
+	wq->wq_npending--;
+	pthread_mutex_unlock(&wq->wq_lock);
+
+	rv = item->wi_arg;
+	free(item);
+	return rv;
+}
+
+
+/* items not collected by workq_next are run, then discarded */
+void workq_fini(workq_t *wq)
+{
+	int i;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	wq->wq_stop = 1;
+	pthread_cond_broadcast(&wq->wq_work);
+	pthread_mutex_unlock(&wq->wq_lock);
+
+	for (i = 0; i < wq->wq_nthreads; i++)
+		pthread_join(wq->wq_threads[i], NULL);
+
+	while (workq_next(wq))
+		;
+
+	pthread_mutex_destroy(&wq->wq_lock);
+	pthread_cond_destroy(&wq->wq_work);
+	pthread_cond_destroy(&wq->wq_done);
+	free(wq->wq_threads);
+	memset(wq, 0, sizeof(workq_t));
+	free(wq);
+}
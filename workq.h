@@ -0,0 +1,55 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Pool of worker threads whose results are collected in submission order.
+ */
+
+#ifndef _WORKQ_H
+#define _WORKQ_H 1
+
+#include <pthread.h>
+
+typedef void (*workq_fn_t)(void *arg);
+
+typedef struct wq_item {
+	workq_fn_t	wi_fn;
+	void		*wi_arg;
+	int		wi_done;
+	struct wq_item	*wi_next;
+} wq_item_t;
+
+typedef struct {
+	pthread_mutex_t	wq_lock;
+	pthread_cond_t	wq_work;	/* item queued, or stopping */
+	pthread_cond_t	wq_done;	/* item finished */
+	pthread_t	*wq_threads;
+	int		wq_nthreads;
+	wq_item_t	*wq_head;	/* oldest item not yet collected */
+	wq_item_t	*wq_tail;
+	wq_item_t	*wq_todo;	/* oldest item not yet started */
+	int		wq_npending;	/* submitted, not yet collected */
+	int		wq_stop;
+} workq_t;
+
+extern workq_t *workq_init(int nthreads);
+extern int workq_submit(workq_t *wq, workq_fn_t fn, void *arg);
+extern int workq_pending(workq_t *wq);
+extern void *workq_next(workq_t *wq);
+extern void workq_fini(workq_t *wq);
+
+#endif /* _WORKQ_H */
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Record of files extracted by earlier runs, for incremental extraction.
+ *
+ * The state file (-I) is a text file:
+ *	tsbtap-state 1
+ * followed by one line per extracted file:
+ *	<id> <name> <length> <access date> <source hash> <output hash>
+ *	    <TAB> <tape> <TAB> <output file>
+ * A file is unchanged if its tape, directory entry and blocks on tape
+ * hash the same as when it was extracted, and the output file is still
+ * as written. Tapes running in parallel (-B -j) share the state.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sink.h"
+#include "xstate.h"
+#include "tsbtap.h"
+
+#define XS_MAGIC	"tsbtap-state 1"
+#define XS_HASHSZ	1024	/* power of 2 */
+
+typedef struct xs_ent {
+	char		*xe_tape;
+	char		xe_uid[5];
+	char		xe_name[7];
+	int		xe_len;
+	unsigned	xe_adate;
+	uint64_t	xe_src;
+	uint64_t	xe_outh;	/* hash of output file */
+	char		*xe_out;
+	int		xe_seen;	/* matched or replaced in this run */
+	struct xs_ent	*xe_next;	/* same hash chain */
+	struct xs_ent	*xe_link;	/* all entries, in order added */
+} xs_ent_t;
+
+struct xstate {
+	pthread_mutex_t	xs_lock;
+	char		*xs_path;
+	int		xs_dirty;	/* needs saving */
+	xs_ent_t	*xs_hash[XS_HASHSZ];
+	xs_ent_t	*xs_head;
+	xs_ent_t	**xs_tail;
+};
+
+
+static unsigned xs_hash(char *tape, char *uid, char *name)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+	char *s[3];
+	int i;
+
+	s[0] = tape; s[1] = uid; s[2] = name;
+	for (i = 0; i < 3; i++)
+		for ( ; *s[i]; s[i]++) {
+			h ^= (unsigned char) *s[i];
+			h *= 16777619u;
+		}
+	return h & (XS_HASHSZ - 1);
+}
+
+
+/* returns NULL if out of memory */
+static xs_ent_t *xs_add(xstate_t *xs, char *tape, char *uid, char *name)
+{
+	xs_ent_t *ent, **hp;
+
+	if (!(ent = calloc(1, sizeof(xs_ent_t))))
+		return NULL;
+	if (!(ent->xe_tape = strdup(tape))) {
+		free(ent);
+		return NULL;
+	}
+	snprintf(ent->xe_uid, sizeof ent->xe_uid, "%s", uid);
+	snprintf(ent->xe_name, sizeof ent->xe_name, "%s", name);
+
+	/* keep chains in order, so duplicates are matched up in order */
+	for (hp = &xs->xs_hash[xs_hash(tape, uid, name)]; *hp;
+	     hp = &(*hp)->xe_next)
+		;
+	*hp = ent;
+	*xs->xs_tail = ent;
+	xs->xs_tail = &ent->xe_link;
+	return ent;
+}
+
+
+/* FNV-1a hash of file contents; returns -1 if it can't be read */
+static int hash_file(char *path, uint64_t *hp)
+{
+	char buf[8192];
+	FILE *fp;
+	SINK *snp;
+	size_t n;
+	int rv = 0;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	if (!(snp = sink_inithash())) {
+		fclose(fp);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+		sink_write(snp, buf, n);
+	if (ferror(fp))
+		rv = -1;
+	*hp = sink_hashval(snp);
+	sink_fini(snp);
+	fclose(fp);
+	return rv;
+}
+
+
+/* is output file still as extracted? */
+static int out_intact(xs_ent_t *ent)
+{
+	uint64_t h;
+
+	return hash_file(ent->xe_out, &h) == 0 && h == ent->xe_outh;
+}
+
+
+/* returns -1 if error */
+static int xs_load(xstate_t *xs, FILE *fp)
+{
+	char *line = NULL, *tape, *out, uid[8], name[8];
+	size_t linesz = 0;
+	ssize_t len;
+	xs_ent_t ent, *ep;
+	int rv = 0, n = 1;
+
+	if ((len = getline(&line, &linesz, fp)) < 0 ||
+	    strcmp(line, XS_MAGIC "\n") != 0) {
+		fprintf(stderr, "%s: not a tsbtap state file\n", xs->xs_path);
+		free(line);
+		return -1;
+	}
+
+	while ((len = getline(&line, &linesz, fp)) >= 0) {
+		n++;
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = '\0';
+		tape = strchr(line, '\t');
+		out = tape ? strchr(tape+1, '\t') : NULL;
+		if (!out || sscanf(line, "%4s %6s %d %u %" SCNx64 " %" SCNx64,
+				   uid, name, &ent.xe_len, &ent.xe_adate,
+				   &ent.xe_src, &ent.xe_outh) != 6) {
+			fprintf(stderr, "%s: line %d: bad format\n",
+				xs->xs_path, n);
+			rv = -1;
+			break;
+		}
+		*tape++ = *out++ = '\0';
+
+		if (!(ep = xs_add(xs, tape, uid, name)) ||
+		    !(ep->xe_out = strdup(out))) {
+			fprintf(stderr, "%s: out of memory\n", xs->xs_path);
+			rv = -1;
+			break;
+		}
+		ep->xe_len = ent.xe_len;
+		ep->xe_adate = ent.xe_adate;
+		ep->xe_src = ent.xe_src;
+		ep->xe_outh = ent.xe_outh;
+	}
+
+	free(line);
+	return rv;
+}
+
+
+/* write to temp file, then rename; returns -1 if error */
+static int xs_save(xstate_t *xs)
+{
+	FILE *fp;
+	char *tmp;
+	xs_ent_t *ent;
+
+	if (!(tmp = malloc(strlen(xs->xs_path) + 5)))
+		return -1;
+	sprintf(tmp, "%s.new", xs->xs_path);
+
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "%s\n", XS_MAGIC);
+	for (ent = xs->xs_head; ent; ent = ent->xe_link) {
+		/* forget files that are gone */
+		if (!ent->xe_out || access(ent->xe_out, F_OK) < 0)
+			continue;
+		fprintf(fp, "%s %s %d %u %016" PRIx64 " %016" PRIx64
+			"\t%s\t%s\n", ent->xe_uid, ent->xe_name, ent->xe_len,
+			ent->xe_adate, ent->xe_src, ent->xe_outh,
+			ent->xe_tape, ent->xe_out);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, xs->xs_path) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+	return 0;
+}
+
+
+/* load state from path, if it exists */
+/* returns NULL if error */
+xstate_t *xs_open(char *path)
+{
+	xstate_t *xs;
+	FILE *fp;
+
+	if (!(xs = calloc(1, sizeof(xstate_t))) ||
+	    !(xs->xs_path = strdup(path))) {
+		fprintf(stderr, "%s: out of memory\n", path);
+		free(xs);
+		return NULL;
+	}
+	pthread_mutex_init(&xs->xs_lock, NULL);
+	xs->xs_tail = &xs->xs_head;
+
+	if ((fp = fopen(path, "r"))) {
+		if (xs_load(xs, fp) < 0) {
+			fclose(fp);
+			xs_close(xs);
+			return NULL;
+		}
+		fclose(fp);
+	} else if (errno != ENOENT) {
+		perror(path);
+		xs_close(xs);
+		return NULL;
+	} else
+		xs->xs_dirty = 1;
+
+	return xs;
+}
+
+
+/* save state if changed, and free it */
+/* returns -1 if error */
+int xs_close(xstate_t *xs)
+{
+	xs_ent_t *ent, *next;
+	int rv = 0;
+
+	if (xs->xs_dirty)
+		rv = xs_save(xs);
+
+	for (ent = xs->xs_head; ent; ent = next) {
+		next = ent->xe_link;
+		free(ent->xe_tape);
+		free(ent->xe_out);
+		free(ent);
+	}
+	pthread_mutex_destroy(&xs->xs_lock);
+	free(xs->xs_path);
+	free(xs);
+	return rv;
+}
+
+
+/*
+ * Returns output file if key's file is unchanged since it was extracted,
+ * else NULL. Then, if an earlier extraction of the file is to be
+ * replaced, key->xk_prev is set, and key->xk_prevout if its output was
+ * not changed since (and so may be removed).
+ */
+char *xs_lookup(xstate_t *xs, xs_key_t *key)
+{
+	xs_ent_t *ent, *prev = NULL;
+
+	key->xk_prev = NULL;
+	key->xk_prevout = NULL;
+
+	pthread_mutex_lock(&xs->xs_lock);
+	for (ent = xs->xs_hash[xs_hash(key->xk_tape, key->xk_uid,
+				       key->xk_name)];
+	     ent; ent = ent->xe_next) {
+		if (ent->xe_seen || strcmp(ent->xe_uid, key->xk_uid) != 0 ||
+		    strcmp(ent->xe_name, key->xk_name) != 0 ||
+		    strcmp(ent->xe_tape, key->xk_tape) != 0)
+			continue;
+		if (ent->xe_len == key->xk_len &&
+		    ent->xe_adate == key->xk_adate &&
+		    ent->xe_src == key->xk_src) {
+			prev = ent;
+			break;
+		}
+		if (!prev)
+			prev = ent;
+	}
+	if (prev)
+		prev->xe_seen = 1;
+	pthread_mutex_unlock(&xs->xs_lock);
+
+	if (!prev)
+		return NULL;
+
+	/* read output without holding up other tapes */
+	key->xk_prev = prev;
+	if (!out_intact(prev))
+		return NULL;
+	if (ent)
+		return prev->xe_out;
+	key->xk_prevout = prev->xe_out;
+	return NULL;
+}
+
+
+/* note that key's file was extracted to outpath */
+/* returns -1 if error */
+int xs_record(xstate_t *xs, xs_key_t *key, char *outpath)
+{
+	xs_ent_t *ent;
+	uint64_t h;
+	char *out;
+
+	if (hash_file(outpath, &h) < 0) {
+		perror(outpath);
+		return -1;
+	}
+	if (!(out = strdup(outpath))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&xs->xs_lock);
+	ent = key->xk_prev;
+	if (!ent && !(ent = xs_add(xs, key->xk_tape, key->xk_uid,
+				   key->xk_name))) {
+		pthread_mutex_unlock(&xs->xs_lock);
+		fprintf(stderr, "Out of memory\n");
+		free(out);
+		return -1;
+	}
+	free(ent->xe_out);
+	ent->xe_out = out;
+	ent->xe_len = key->xk_len;
+	ent->xe_adate = key->xk_adate;
+	ent->xe_src = key->xk_src;
+	ent->xe_outh = h;
+	ent->xe_seen = 1;
+	xs->xs_dirty = 1;
+	pthread_mutex_unlock(&xs->xs_lock);
+
+	key->xk_prev = NULL;
+	return 0;
+}
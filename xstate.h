@@ -0,0 +1,45 @@
+/*
+ * Copyright 2024 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Record of files extracted by earlier runs, for incremental extraction.
+ */
+
+#ifndef _XSTATE_H
+#define _XSTATE_H 1
+
+struct xs_ent;
+typedef struct xstate xstate_t;
+
+/* file about to be extracted */
+typedef struct {
+	char		*xk_tape;	/* tape identity: real path of image */
+	char		xk_uid[5];
+	char		xk_name[7];
+	int		xk_len;		/* as on tape */
+	unsigned	xk_adate;	/* access date, as on tape */
+	uint64_t	xk_src;		/* hash of file's blocks */
+	struct xs_ent	*xk_prev;	/* earlier extraction to replace */
+	char		*xk_prevout;	/* its file, to remove; or NULL */
+} xs_key_t;
+
+extern xstate_t *xs_open(char *path);
+extern int xs_close(xstate_t *xs);
+extern char *xs_lookup(xstate_t *xs, xs_key_t *key);
+extern int xs_record(xstate_t *xs, xs_key_t *key, char *outpath);
+
+#endif /* _XSTATE_H */